@@ -0,0 +1,249 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <sys/resource.h>
+
+#include "../src/model.h"
+#include "nlohmann/json.hpp"
+
+// Replays a prompt corpus through Model::respond and reports the timings as JSON
+
+struct BenchOptions {
+    std::string modelPath;
+    std::string promptsPath = "bench/prompts.json";
+    std::string outputPath; // empty to only print the results
+    std::string mode = "both"; // "command", "chat" or "both"
+    int ngl = 0;
+    int n_ctx = 4096;
+    int runs = 3;
+    int maxTokens = 128; // generated tokens per chat response
+    std::vector<int> syntheticSizes = {32, 256, 1024}; // words of the synthetic prompts
+};
+
+// Peak resident set size of the process in MiB
+double peakRssMiB() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0; // kilobytes on Linux
+}
+
+// Value at the given percentile, nearest rank
+double percentile(std::vector<double> values, const double p) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t rank = (size_t)std::ceil(p / 100.0 * values.size());
+    return values[std::clamp(rank, (size_t)1, values.size()) - 1];
+}
+
+// Aggregates the timings of a set of requests
+nlohmann::json summarize(const std::vector<Model::PerfStats> &perfs) {
+    int promptTokens = 0;
+    int generatedTokens = 0;
+    double prefillMs = 0.0;
+    double decodeMs = 0.0;
+    double sampleMs = 0.0;
+    double totalMs = 0.0;
+    std::vector<double> ttft;
+    for (const auto &perf : perfs) {
+        promptTokens += perf.prompt_tokens;
+        generatedTokens += perf.generated_tokens;
+        prefillMs += perf.prefill_ms;
+        decodeMs += perf.decode_ms;
+        sampleMs += perf.sample_ms;
+        totalMs += perf.total_ms;
+        if (perf.generated_tokens > 0) {
+            ttft.push_back(perf.ttft_ms);
+        }
+    }
+    return {
+        {"requests", perfs.size()},
+        {"prompt_tokens", promptTokens},
+        {"generated_tokens", generatedTokens},
+        {"prefill_tps", prefillMs > 0 ? promptTokens * 1000.0 / prefillMs : 0.0},
+        {"decode_tps", decodeMs > 0 ? generatedTokens * 1000.0 / decodeMs : 0.0},
+        {"sample_ms", sampleMs},
+        {"mean_total_ms", perfs.empty() ? 0.0 : totalMs / perfs.size()},
+        {"ttft_ms", {
+            {"p50", percentile(ttft, 50)},
+            {"p90", percentile(ttft, 90)},
+            {"p99", percentile(ttft, 99)}
+        }}
+    };
+}
+
+// Prompts of roughly the given number of words, so prefill is measured across prompt sizes
+std::vector<std::string> syntheticPrompts(const std::vector<int> &sizes) {
+    static const std::vector<std::string> words = {
+        "the", "lights", "in", "kitchen", "should", "turn", "on", "when", "someone", "walks",
+        "through", "door", "after", "sunset", "and", "stay", "for", "ten", "minutes", "unless"
+    };
+    std::vector<std::string> prompts;
+    for (int size : sizes) {
+        std::string prompt = "Repeat the last word of this text:";
+        for (int i = 0; i < size; i++) {
+            prompt += " " + words[(i * 7) % words.size()];
+        }
+        prompts.push_back(prompt);
+    }
+    return prompts;
+}
+
+/*
+    Runs every prompt through a model in the given mode.
+    BenchOptions &options             || Benchmark settings
+    std::string &mode                 || "command" starts every request from the system prompt, "chat" keeps the history
+    std::vector<std::string> &recorded || Prompts taken from real use
+    returns                           || Results of the mode
+*/
+nlohmann::json benchMode(const BenchOptions &options, const std::string &mode, const std::vector<std::string> &recorded) {
+    const bool chat = mode == "chat";
+    const std::string system = chat
+        ? "You are a helpful home assistant. Answer briefly."
+        : "You can only respond with the phrase that closest matches the user's command. Here are the phrases: "
+          "turn on the <arg1> lights, turn off the <arg1> lights, what time is it, what is the date, "
+          "set the thermostat to <arg1>, open the <arg1>, play <arg1->";
+
+    auto begin = std::chrono::steady_clock::now();
+    Model model("Bench", chat ? "Chat" : "Command", options.modelPath, options.ngl, options.n_ctx,
+                system, 0.4f, 0.05f, 0.95f, 0.95f, 0.9f, 25, chat, false);
+    if (chat) {
+        model.setMaxTokens(options.maxTokens);
+        model.setContextPolicy("shift");
+    } else {
+        model.setMaxTokens(32);
+        model.setStopSequences({"\n"});
+    }
+    model.init();
+    std::chrono::duration<double, std::milli> loadMs = std::chrono::steady_clock::now() - begin;
+
+    // warm up the caches before anything is measured
+    model.respond("Hello");
+    model.clearHistory();
+
+    std::vector<Model::PerfStats> synthetic;
+    std::vector<Model::PerfStats> real;
+    for (int run = 0; run < options.runs; run++) {
+        for (const auto &prompt : syntheticPrompts(options.syntheticSizes)) {
+            model.clearHistory(); // long synthetic prompts are not part of a conversation
+            model.respond(prompt);
+            synthetic.push_back(model.getLastPerf());
+        }
+        model.clearHistory();
+        for (const auto &prompt : recorded) {
+            model.respond(prompt);
+            real.push_back(model.getLastPerf());
+        }
+    }
+
+    std::vector<Model::PerfStats> all = synthetic;
+    all.insert(all.end(), real.begin(), real.end());
+    Model::MemoryUsage memory = model.getMemoryUsage();
+    return {
+        {"load_ms", loadMs.count()},
+        {"weights_mib", memory.weights / (1024.0 * 1024.0)},
+        {"kv_cache_mib", memory.kv_cache / (1024.0 * 1024.0)},
+        {"synthetic", summarize(synthetic)},
+        {"recorded", summarize(real)},
+        {"total", summarize(all)},
+        {"peak_rss_mib", peakRssMiB()}
+    };
+}
+
+int main(int argc, char *argv[]) {
+    BenchOptions options;
+
+    // Processing command line arguments
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--help" || arg == "-h") {
+            std::cout << "Usage: benchModel <model.gguf> [options]\n"
+                      << "Options:\n"
+                      << " --prompts <file>     Recorded prompts, default bench/prompts.json\n"
+                      << " --mode <mode>        command, chat or both, default both\n"
+                      << " --runs <n>           Times the corpus is replayed, default 3\n"
+                      << " --ngl <n>            Layers offloaded to the GPU, default 0\n"
+                      << " --ctx <n>            Context size, default 4096\n"
+                      << " --max-tokens <n>     Tokens per chat response, default 128\n"
+                      << " --output <file>      Also write the results to the file\n";
+            return 0;
+        } else if (arg == "--prompts" && hasValue) {
+            options.promptsPath = argv[++i];
+        } else if (arg == "--mode" && hasValue) {
+            options.mode = argv[++i];
+        } else if (arg == "--runs" && hasValue) {
+            options.runs = std::stoi(argv[++i]);
+        } else if (arg == "--ngl" && hasValue) {
+            options.ngl = std::stoi(argv[++i]);
+        } else if (arg == "--ctx" && hasValue) {
+            options.n_ctx = std::stoi(argv[++i]);
+        } else if (arg == "--max-tokens" && hasValue) {
+            options.maxTokens = std::stoi(argv[++i]);
+        } else if (arg == "--output" && hasValue) {
+            options.outputPath = argv[++i];
+        } else if (arg.rfind("--", 0) != 0 && options.modelPath.empty()) {
+            options.modelPath = arg;
+        } else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (options.modelPath.empty()) {
+        std::cerr << "No model given, see --help" << std::endl;
+        return 1;
+    }
+    if (options.mode != "command" && options.mode != "chat" && options.mode != "both") {
+        std::cerr << "Unknown mode: " << options.mode << std::endl;
+        return 1;
+    }
+
+    // Load the recorded prompts
+    nlohmann::json prompts;
+    std::ifstream promptsFile(options.promptsPath);
+    if (!promptsFile) {
+        std::cerr << "Failed to open " << options.promptsPath << std::endl;
+        return 1;
+    }
+    try {
+        prompts = nlohmann::json::parse(promptsFile);
+    } catch (const std::exception &e) {
+        std::cerr << "Error parsing " << options.promptsPath << ": " << e.what() << std::endl;
+        return 1;
+    }
+
+    nlohmann::json results = {
+        {"model", std::filesystem::path(options.modelPath).filename().string()},
+        {"system_info", llama_print_system_info()},
+        {"n_ctx", options.n_ctx},
+        {"ngl", options.ngl},
+        {"runs", options.runs}
+    };
+    try {
+        for (const std::string mode : {"command", "chat"}) {
+            if (options.mode == mode || options.mode == "both") {
+                results[mode] = benchMode(options, mode, prompts.value(mode, std::vector<std::string>{}));
+            }
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "Benchmark failed: " << e.what() << std::endl;
+        return 1;
+    }
+    results["peak_rss_mib"] = peakRssMiB();
+
+    std::cout << results.dump(4) << std::endl;
+    if (!options.outputPath.empty()) {
+        std::ofstream output(options.outputPath);
+        if (!output) {
+            std::cerr << "Failed to write " << options.outputPath << std::endl;
+            return 1;
+        }
+        output << results.dump(4) << std::endl;
+    }
+    return 0;
+}
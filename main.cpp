@@ -1,17 +1,20 @@
 #include "src/model.h"
+#include "src/modelRegistry.h"
+#include "src/memoryManager.h"
 #include "src/functionCall.h"
 #include "src/mqtt.h"
 #include "src/configReader.h"
 #include "src/voice.h"
+#include "src/asyncLoader.h"
+#include "src/intentMatcher.h"
+#include "src/commandCache.h"
 
 int main(int argc, char *argv[]) {
 
-    std::string response;
     std::string commandString;
-    std::string userInput, input;
+    std::string userInput;
     std::string commandInitMessage;
     bool isVerbose = false;
-    bool retry = false;
     bool ttsEnabled = true;
 
     ConfigVars::config config;
@@ -22,6 +25,9 @@ int main(int argc, char *argv[]) {
     std::unique_ptr<FunctionCall::ParsedPhrase> parsedPhrasePtr = nullptr;
     ConfigReader configReader;
     Voice voice;
+    IntentMatcher intentMatcher;
+    CommandCache commandCache;
+    AsyncLoader loader; // destroyed first, queued work uses the components above
 
 
     // Processing command line arguments
@@ -50,27 +56,21 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     config = configReader.getConfig();
+    loader.setVerbose(isVerbose);
 
-    // Initialize MQTT client
+    // Initialize MQTT client, the components load in parallel in the background
     mqttConfig = configReader.getMQTTConfig();
 
     if (mqttConfig.enabled) {
         client.setVerbose(isVerbose);
-        if (mqttConfig.enabled) {
-            try {
-                std::cout << "Initializing MQTT client... ";
-                client.Init(mqttConfig.username, mqttConfig.password, mqttConfig.client_id, mqttConfig.clean_session);
-                if (client.isInitialized()) {
-                    client.Start(mqttConfig.broker_ip, mqttConfig.broker_port, mqttConfig.keepalive);
-                } else {
-                    throw std::runtime_error("MQTT client initialization failed.");
-                }
-                std::cout << "Done." << std::endl;
-            } catch (const std::exception &e) {
-                std::cerr << "Error initializing MQTT client: " << e.what() << std::endl;
-                return 1;
+        loader.start("MQTT client", [&client, mqttConfig]() {
+            client.Init(mqttConfig.username, mqttConfig.password, mqttConfig.client_id, mqttConfig.clean_session);
+            if (client.isInitialized()) {
+                client.Start(mqttConfig.broker_ip, mqttConfig.broker_port, mqttConfig.keepalive);
+            } else {
+                throw std::runtime_error("MQTT client initialization failed.");
             }
-        }
+        });
     }
 
     // Initialize the models
@@ -95,6 +95,32 @@ int main(int argc, char *argv[]) {
             }
         }
 
+        // Idle models are unloaded when the models together exceed the budget
+        MemoryManager::setBudget((uint64_t)config.memoryBudget * 1024 * 1024);
+
+        // Models with the same context group share one context, each in its own sequence
+        struct GroupSize {
+            int n_seq_max = 0;
+            int n_ctx = 0;
+            int n_batch = 0;
+            int n_ubatch = 0;
+        };
+        std::map<std::string, GroupSize> contextGroups;
+        for (const auto& modelConfig : configReader.getModels()) {
+            if (!modelConfig.context_group.empty()) {
+                GroupSize &size = contextGroups[modelConfig.context_group];
+                // every conversation the model holds at once is a sequence of its own
+                size.n_seq_max += modelConfig.sessions;
+                size.n_ctx += modelConfig.n_ctx * modelConfig.sessions;
+                // the largest batch sizes of the group, a benchmarked or default n_batch is at most the model's n_ctx
+                size.n_batch = std::max(size.n_batch, modelConfig.n_batch > 0 ? std::min(modelConfig.n_batch, modelConfig.n_ctx) : modelConfig.n_ctx);
+                size.n_ubatch = std::max(size.n_ubatch, modelConfig.n_ubatch);
+            }
+        }
+        for (const auto& [group, size] : contextGroups) {
+            ModelRegistry::declareContextGroup(group, size.n_seq_max, size.n_ctx, size.n_batch, size.n_ubatch);
+        }
+
         for (const auto& modelConfig : configReader.getModels()) {
             if (modelConfig.purpose == "Command") {
                 commandModel.setModelName(modelConfig.name);
@@ -110,6 +136,41 @@ int main(int argc, char *argv[]) {
                 commandModel.setDist(modelConfig.dist);
                 commandModel.setTopK(modelConfig.top_k);
                 commandModel.setKeepHistory(modelConfig.keepHistory);
+                commandModel.setCacheDir(modelConfig.cache_dir);
+                commandModel.setContextGroup(modelConfig.context_group);
+                commandModel.setDraftPath(modelConfig.draft_path);
+                commandModel.setNDraft(modelConfig.n_draft);
+                commandModel.setLookupNgram(modelConfig.lookup_ngram);
+                commandModel.setContextPolicy(modelConfig.context_policy);
+                commandModel.setSummaryBudget(modelConfig.summary_budget);
+                commandModel.setSummaryIdle(modelConfig.summary_idle);
+                commandModel.setMaxTokens(modelConfig.max_tokens);
+                commandModel.setStopSequences(modelConfig.stop);
+                commandModel.setNBatch(modelConfig.n_batch);
+                commandModel.setNUbatch(modelConfig.n_ubatch);
+                commandModel.setNThreads(modelConfig.n_threads);
+                commandModel.setNThreadsBatch(modelConfig.n_threads_batch);
+                commandModel.setTypeK(modelConfig.type_k);
+                commandModel.setTypeV(modelConfig.type_v);
+                commandModel.setFlashAttn(modelConfig.flash_attn);
+                commandModel.setIdleUnload(modelConfig.idle_unload);
+                commandModel.setUnloadWeights(modelConfig.unload_weights);
+                commandModel.setPerfLog(modelConfig.perf_log);
+                commandModel.setSessions(modelConfig.sessions);
+                commandModel.setParallel(modelConfig.parallel);
+                if (modelConfig.grammar) {
+                    // Only allow answers that parsePhrase can match
+                    commandModel.setGrammar(FunctionCall::buildGrammar(configReader.getCommandCalls(), "Command not recognized."));
+                }
+                if (modelConfig.complete_phrases) {
+                    // Stop sampling as soon as the phrase is determined, the literal text is filled in directly
+                    std::vector<ConfigVars::Commands> commandCalls = configReader.getCommandCalls();
+                    commandModel.setCompletionHook([commandCalls](const std::string &response) {
+                        Model::Completion completion;
+                        completion.complete = FunctionCall::completePhrase(response, commandCalls, "Command not recognized.", completion.text);
+                        return completion;
+                    });
+                }
                 commandModel.setVerbose(isVerbose);
                 if (isVerbose) std::cout << "Command Model initialized: " << commandModel.getModelName() << std::endl;
             } else if (modelConfig.purpose == "Chat") {
@@ -126,18 +187,52 @@ int main(int argc, char *argv[]) {
                 chatModel.setDist(modelConfig.dist);
                 chatModel.setTopK(modelConfig.top_k);
                 chatModel.setKeepHistory(modelConfig.keepHistory);
+                chatModel.setCacheDir(modelConfig.cache_dir);
+                chatModel.setContextGroup(modelConfig.context_group);
+                chatModel.setDraftPath(modelConfig.draft_path);
+                chatModel.setNDraft(modelConfig.n_draft);
+                chatModel.setLookupNgram(modelConfig.lookup_ngram);
+                chatModel.setContextPolicy(modelConfig.context_policy);
+                chatModel.setSummaryBudget(modelConfig.summary_budget);
+                chatModel.setSummaryIdle(modelConfig.summary_idle);
+                chatModel.setMaxTokens(modelConfig.max_tokens);
+                chatModel.setStopSequences(modelConfig.stop);
+                chatModel.setNBatch(modelConfig.n_batch);
+                chatModel.setNUbatch(modelConfig.n_ubatch);
+                chatModel.setNThreads(modelConfig.n_threads);
+                chatModel.setNThreadsBatch(modelConfig.n_threads_batch);
+                chatModel.setTypeK(modelConfig.type_k);
+                chatModel.setTypeV(modelConfig.type_v);
+                chatModel.setFlashAttn(modelConfig.flash_attn);
+                chatModel.setIdleUnload(modelConfig.idle_unload);
+                chatModel.setUnloadWeights(modelConfig.unload_weights);
+                chatModel.setPerfLog(modelConfig.perf_log);
+                chatModel.setSessionFile(modelConfig.session_file);
+                chatModel.setSessionInterval(modelConfig.session_interval);
+                chatModel.setSessions(modelConfig.sessions);
                 chatModel.setVerbose(isVerbose);
                 if (isVerbose) std::cout << "Chat Model initialized: " << chatModel.getModelName() << std::endl;
             }
         }
-        try {
-            std::cout << "Initializing models... ";
-            commandModel.init();
-            chatModel.init();
-            std::cout << "Done." << std::endl;
-        } catch (const std::exception &e) {
-            std::cerr << "Error initializing command model: " << e.what() << std::endl;
-            return 1;
+        // weights of different files are read in parallel, requests for a model are queued until it is ready
+        std::cout << "Loading models in the background..." << std::endl;
+        loader.start("command model", [&commandModel]() { commandModel.init(); });
+        loader.start("chat model", [&chatModel]() { chatModel.init(); });
+
+        // Phrases are embedded once, paraphrased commands are then matched without generating
+        if (config.intentMatcher.enabled) {
+            if (config.intentMatcher.model_path.empty()) {
+                intentMatcher.setModelPath(commandModel.getModelPath());
+                intentMatcher.setNGL(commandModel.getNGL());
+            } else {
+                intentMatcher.setModelPath(config.intentMatcher.model_path);
+                intentMatcher.setNGL(config.intentMatcher.ngl);
+            }
+            intentMatcher.setThreshold(config.intentMatcher.threshold);
+            intentMatcher.setMargin(config.intentMatcher.margin);
+            intentMatcher.setVerbose(isVerbose);
+            std::vector<ConfigVars::Commands> commandCalls = configReader.getCommandCalls();
+            loader.start("intent matcher", [&intentMatcher, commandCalls]() { intentMatcher.init(commandCalls); });
         }
     }
 
@@ -154,14 +249,15 @@ int main(int argc, char *argv[]) {
             voice.setNoiseWScale(config.voice.noise_w_scale);
             voice.setVerbose(isVerbose);
             voice.setEnabled(config.voice.enabled);
-        try {
-            std::cout << "Initializing voice synthesizer... ";
-            voice.init();
-            std::cout << "Done." << std::endl;
-        } catch (const std::exception &e) {
-            std::cerr << "Error initializing voice synthesizer: " << e.what() << std::endl;
-            return 1;
-        }
+        loader.start("voice synthesizer", [&voice]() { voice.init(); });
+    }
+
+    // Responses of the command model from earlier runs, dropped if the commands changed
+    if (config.ModelEnable && config.commandCache.enabled) {
+        commandCache.setCapacity(config.commandCache.capacity);
+        commandCache.setPath(config.commandCache.path);
+        commandCache.setVerbose(isVerbose);
+        commandCache.load(configReader.getCommandCalls());
     }
 
     // Initialize function calls
@@ -174,58 +270,127 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    // Commands run one at a time, either from the prompt or from the queue of the loader
+    std::mutex executeMutex;
+    auto speakText = [&](const std::string &text) {
+        if (!ttsEnabled || !config.voice.enabled || text.empty()) return;
+        if (!loader.wait("voice synthesizer")) return;
+        try {
+            voice.speak(text);
+        } catch (const std::exception &e) {
+            std::cerr << "Error during TTS synthesis: " << e.what() << std::endl;
+        }
+    };
+    auto execute = [&](const std::unique_ptr<FunctionCall::ParsedPhrase> &parsed) {
+        std::lock_guard<std::mutex> lock(executeMutex);
+        if (isVerbose) {
+            std::cout << "Command: " << parsed->command << std::endl;
+            for (const auto& arg : parsed->arguments) {
+                std::cout << "Argument: " << arg << std::endl;
+            }
+        }
+        // the voice and the broker connect quickly, the commands may use them
+        loader.wait("voice synthesizer");
+        loader.wait("MQTT client");
+        if (FunctionCall::needsModel(parsed->command) && !loader.wait("chat model")) {
+            std::cout << "The chat model is not available." << std::endl;
+            return;
+        }
+        std::string response = FunctionCall::call(parsed, config, isVerbose);
+        std::cout << response << std::endl;
+        if (!FunctionCall::speaksResponse(parsed->command)) {
+            speakText(response);
+        }
+    };
+    auto couldNotParse = [&]() {
+        // a command of the loader queue may be speaking
+        std::lock_guard<std::mutex> lock(executeMutex);
+        std::cout << "Could not parse command." << std::endl;
+        speakText("Could not parse command.");
+    };
+    // the command model rephrases the input into one of the phrases
+    auto askCommandModel = [&](const std::string &text) {
+        if (isVerbose) std::cout << "Retrying with AI parsed command..." << std::endl;
+        std::string input;
+        try {
+            input = commandModel.respond(text);
+        } catch (const std::exception &e) {
+            std::cerr << "Error generating command from AI: " << e.what() << std::endl;
+            return;
+        }
+        if (isVerbose) std::cout << "AI parsed command: " << input << std::endl;
+        std::unique_ptr<FunctionCall::ParsedPhrase> parsed;
+        if (FunctionCall::parsePhrase(input, parsed, configReader.getCommandCalls(), isVerbose)) {
+            if (config.commandCache.enabled) {
+                commandCache.put(text, input, *parsed);
+            }
+            execute(parsed);
+        } else {
+            couldNotParse();
+        }
+    };
+
     std::cout << "Azazel Assistant v0.3 is running...\n";
     // Main loop
     while (true) {
-        if (!retry || !config.ModelEnable) {
-            std::cout << "> ";
-            getline(std::cin, userInput);
-            input = userInput;
-            if (userInput == "quit" || userInput == "q") break;
-        } else {
-            if (isVerbose) std::cout << "Retrying with AI parsed command..." << std::endl;
-            try {
-                    input = commandModel.respond(userInput);
-            } catch (const std::exception &e) {
-                std::cerr << "Error generating command from AI: " << e.what() << std::endl;
-                return 1;
-            }
-            if (isVerbose) std::cout << "AI parsed command: " << input << std::endl;
-        }
-        if (FunctionCall::parsePhrase(input, parsedPhrasePtr, configReader.getCommandCalls(), isVerbose)) {
-            if (isVerbose) {
-                std::cout << "Command: " << parsedPhrasePtr->command << std::endl;
-                for (const auto& arg : parsedPhrasePtr->arguments) {
-                    std::cout << "Argument: " << arg << std::endl;
+        std::cout << "> ";
+        if (!getline(std::cin, userInput)) break;
+        if (userInput == "quit" || userInput == "q") break;
+
+        try {
+            bool parsed = FunctionCall::parsePhrase(userInput, parsedPhrasePtr, configReader.getCommandCalls(), isVerbose);
+            if (!parsed && config.ModelEnable && config.commandCache.enabled) {
+                // the command model already rephrased this utterance before
+                if (std::optional<CommandCache::Entry> cached = commandCache.get(userInput)) {
+                    if (isVerbose) std::cout << "Cached AI parsed command: " << cached->output << std::endl;
+                    parsedPhrasePtr = std::make_unique<FunctionCall::ParsedPhrase>(cached->parsed);
+                    parsed = true;
                 }
             }
-            response = FunctionCall::call(parsedPhrasePtr, config, isVerbose);
-            std::cout << response << std::endl;
-            if (ttsEnabled && config.voice.enabled) {
-                if (!response.empty()) {
-                    try {
-                        voice.speak(response);
-                    } catch (const std::exception &e) {
-                        std::cerr << "Error during TTS synthesis: " << e.what() << std::endl;
-                    }
+            if (!parsed && config.ModelEnable && config.intentMatcher.enabled && loader.isReady("intent matcher")) {
+                // the closest phrase is only trusted for commands without arguments, the command model fills in arguments
+                IntentMatcher::Match intent = intentMatcher.match(userInput);
+                if (!intent.command.empty() && intent.NArgs == 0) {
+                    if (isVerbose) std::cout << "Matched by embedding: " << intent.phrase << " (" << intent.score << ")" << std::endl;
+                    parsedPhrasePtr = std::make_unique<FunctionCall::ParsedPhrase>();
+                    parsedPhrasePtr->command = intent.command;
+                    parsed = true;
                 }
             }
-            retry = false;
-        } else if (config.ModelEnable && !retry) {
-            retry = true;
-        } else {
-            std::cout << "Could not parse command." << std::endl;
-            if (ttsEnabled && config.voice.enabled) {
-                try {
-                    voice.speak("Could not parse command.");
-                } catch (const std::exception &e) {
-                    std::cerr << "Error during TTS synthesis: " << e.what() << std::endl;
+            if (parsed) {
+                if (FunctionCall::needsModel(parsedPhrasePtr->command) && loader.isLoading("chat model")) {
+                    // pattern matched commands that need no model run right away, this one waits for the chat model
+                    std::cout << "Queued until the chat model is loaded." << std::endl;
+                    FunctionCall::ParsedPhrase phrase = *parsedPhrasePtr;
+                    loader.whenReady("chat model", [&execute, phrase]() {
+                        execute(std::make_unique<FunctionCall::ParsedPhrase>(phrase));
+                    });
+                } else {
+                    execute(parsedPhrasePtr);
+                }
+            } else if (config.ModelEnable) {
+                if (loader.isLoading("command model")) {
+                    std::cout << "Queued until the command model is loaded." << std::endl;
+                    loader.whenReady("command model", [&askCommandModel, userInput]() { askCommandModel(userInput); });
+                } else if (!loader.wait("command model")) {
+                    // a failed load is not retried, queued input would only be dropped
+                    std::cout << "The command model is not available." << std::endl;
+                    couldNotParse();
+                } else {
+                    askCommandModel(userInput);
                 }
+            } else {
+                couldNotParse();
             }
-            retry = false;
+        } catch (const std::exception &e) {
+            std::cerr << "Error executing command: " << e.what() << std::endl;
         }
-        input = "";
         parsedPhrasePtr = nullptr;
     }
+    // queued work refers to the lambdas above
+    if (loader.pending() > 0) {
+        std::cout << "Dropping " << loader.pending() << " queued commands." << std::endl;
+    }
+    loader.stopQueue();
     return 0;
 }
@@ -0,0 +1,119 @@
+#include "asyncLoader.h"
+
+AsyncLoader::~AsyncLoader() {
+    stopQueue();
+    // the futures wait for the initializations that are still running
+}
+
+void AsyncLoader::stopQueue() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stop = true;
+    }
+    cv.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+void AsyncLoader::start(const std::string& component, std::function<void()> init) {
+    bool verbose = isVerbose;
+    std::shared_future<void> loading = std::async(std::launch::async, [component, init, verbose]() {
+        auto begin = std::chrono::steady_clock::now();
+        try {
+            init();
+        } catch (const std::exception& e) {
+            std::cerr << "Error initializing " << component << ": " << e.what() << std::endl;
+            throw;
+        }
+        if (verbose) {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+            std::cout << "Loaded " << component << " in " << elapsed.count() << " s" << std::endl;
+        }
+    }).share();
+
+    std::lock_guard<std::mutex> lock(mtx);
+    components[component] = loading;
+}
+
+std::shared_future<void> AsyncLoader::find(const std::string& component) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = components.find(component);
+    if (it == components.end()) {
+        return {};
+    }
+    return it->second;
+}
+
+bool AsyncLoader::isReady(const std::string& component) {
+    std::shared_future<void> loading = find(component);
+    if (!loading.valid()) {
+        return true;
+    }
+    if (loading.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        return false;
+    }
+    return wait(component);
+}
+
+bool AsyncLoader::isLoading(const std::string& component) {
+    std::shared_future<void> loading = find(component);
+    return loading.valid() && loading.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+}
+
+bool AsyncLoader::wait(const std::string& component) {
+    std::shared_future<void> loading = find(component);
+    if (!loading.valid()) {
+        return true;
+    }
+    try {
+        loading.get();
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+void AsyncLoader::whenReady(const std::string& component, std::function<void()> work) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (stop) return;
+        tasks.push_back({component, std::move(work)});
+        if (!worker.joinable()) {
+            worker = std::thread(&AsyncLoader::workerLoop, this);
+        }
+    }
+    cv.notify_all();
+}
+
+size_t AsyncLoader::pending() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return tasks.size();
+}
+
+void AsyncLoader::workerLoop() {
+    while (true) {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [this]() { return stop || !tasks.empty(); });
+            if (stop) {
+                return;
+            }
+            task = tasks.front();
+        }
+
+        if (wait(task.component)) {
+            try {
+                task.work();
+            } catch (const std::exception& e) {
+                std::cerr << "Error running queued work for " << task.component << ": " << e.what() << std::endl;
+            }
+        } else {
+            std::cerr << "Dropped queued work, " << task.component << " failed to load." << std::endl;
+        }
+
+        std::lock_guard<std::mutex> lock(mtx);
+        tasks.pop_front();
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef ASYNCLOADER_H
+#define ASYNCLOADER_H
+
+#include <string>
+#include <map>
+#include <deque>
+#include <future>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+#include <chrono>
+
+// Initializes components on background threads and runs work that depends on them once they are loaded
+class AsyncLoader {
+private:
+    struct Task {
+        std::string component; // component the work waits for
+        std::function<void()> work;
+    };
+
+    std::map<std::string, std::shared_future<void>> components;
+    std::deque<Task> tasks;
+    std::thread worker;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stop = false;
+    bool isVerbose = false;
+
+    // Runs the queued work in order, each task waits for its component
+    void workerLoop();
+    // Returns the loading state of the component, an unknown component counts as loaded
+    std::shared_future<void> find(const std::string& component);
+
+public:
+    AsyncLoader() = default;
+    ~AsyncLoader();
+    AsyncLoader(const AsyncLoader&) = delete;
+    AsyncLoader& operator=(const AsyncLoader&) = delete;
+
+    /*
+        Starts initializing a component on its own thread, errors are printed and kept for wait.
+        const std::string& component    || Name of the component
+        std::function<void()> init      || Initialization, throws on failure
+    */
+    void start(const std::string& component, std::function<void()> init);
+    /*
+        Whether the component finished initializing without an error.
+        const std::string& component    || Name of the component, unknown components are ready
+    */
+    bool isReady(const std::string& component);
+    /*
+        Whether the component is still initializing, false once it is loaded or failed.
+        const std::string& component    || Name of the component, unknown components are not loading
+    */
+    bool isLoading(const std::string& component);
+    /*
+        Blocks until the component finished initializing.
+        const std::string& component    || Name of the component, unknown components return at once
+        returns                         || false if the initialization failed
+    */
+    bool wait(const std::string& component);
+    /*
+        Queues work until the component is loaded, queued work runs in order on one background thread.
+        Work of a component that fails to load is dropped.
+        const std::string& component    || Name of the component
+        std::function<void()> work      || Work to run
+    */
+    void whenReady(const std::string& component, std::function<void()> work);
+    /*
+        Number of queued tasks that did not run yet.
+    */
+    size_t pending();
+    /*
+        Waits for the running task and drops the queued ones, the loader queues no more work afterwards.
+    */
+    void stopQueue();
+
+    void setVerbose(bool vb) { isVerbose = vb; }
+    bool getVerbose() const { return isVerbose; }
+};
+
+#endif
@@ -0,0 +1,326 @@
+#include "batchScheduler.h"
+
+#include <algorithm>
+
+BatchScheduler::BatchScheduler(std::shared_ptr<llama_model> model, std::shared_ptr<llama_context> ctx, std::shared_ptr<std::recursive_mutex> mtx,
+                               const int n_slots, const int n_ctx, const SamplerFactory &createSampler, const bool isVerbose)
+    : model(std::move(model)), ctx(std::move(ctx)), ctx_mutex(std::move(mtx)), n_ctx_slot(n_ctx), isVerbose(isVerbose) {
+    if (n_slots < 1) {
+        throw std::invalid_argument("A batch scheduler needs at least one slot: " + std::to_string(n_slots));
+    }
+    if (!this->ctx || (int)llama_n_seq_max(this->ctx.get()) < n_slots) {
+        throw std::invalid_argument("The context has fewer sequences than the scheduler has slots");
+    }
+    vocab = llama_model_get_vocab(this->model.get());
+    n_batch = llama_n_batch(this->ctx.get());
+
+    slots.resize(n_slots);
+    for (int i = 0; i < n_slots; i++) {
+        slots[i].seq = i;
+        slots[i].smpl.reset(createSampler());
+        if (!slots[i].smpl) {
+            throw std::runtime_error("Failed to initialize the sampler");
+        }
+    }
+
+    worker = std::thread(&BatchScheduler::run, this);
+}
+
+BatchScheduler::~BatchScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stop = true;
+    }
+    cv.notify_all();
+    if (worker.joinable()) worker.join();
+}
+
+std::future<BatchScheduler::Result> BatchScheduler::submit(Request request) {
+    Pending job;
+    job.request = std::move(request);
+    job.submitted = clock::now();
+    std::future<Result> result = job.result.get_future();
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (stop) {
+            throw std::runtime_error("Batch scheduler is stopped");
+        }
+        queue.push_back(std::move(job));
+    }
+    cv.notify_one();
+    return result;
+}
+
+void BatchScheduler::setPrefix(const llama_seq_id seq, const std::vector<llama_token> &tokens) {
+    prefix_seq = seq;
+    prefix = tokens;
+}
+
+bool BatchScheduler::busy() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return !queue.empty() || std::any_of(slots.begin(), slots.end(), [](const Slot &slot) { return slot.active; });
+}
+
+size_t BatchScheduler::getQueued() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return queue.size();
+}
+
+std::string BatchScheduler::format(const std::string &system, const std::string &prompt) const {
+    std::vector<llama_chat_message> chat = {{"system", system.c_str()}, {"user", prompt.c_str()}};
+    const char* tmpl = llama_model_chat_template(model.get(), /* name */ nullptr);
+
+    std::vector<char> formatted(2 * (system.size() + prompt.size()) + 256);
+    int len = llama_chat_apply_template(tmpl, chat.data(), chat.size(), true, formatted.data(), formatted.size());
+    if (len > (int)formatted.size()) {
+        formatted.resize(len);
+        len = llama_chat_apply_template(tmpl, chat.data(), chat.size(), true, formatted.data(), formatted.size());
+    }
+    if (len < 0) {
+        throw std::runtime_error("Failed to apply the chat template");
+    }
+    return std::string(formatted.begin(), formatted.begin() + len);
+}
+
+std::vector<llama_token> BatchScheduler::tokenize(const std::string &text, const bool add_special) const {
+    int n_tokens = -llama_tokenize(vocab, text.c_str(), text.size(), NULL, 0, add_special, true);
+    std::vector<llama_token> tokens(n_tokens);
+    if (llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), add_special, true) < 0) {
+        throw std::runtime_error("Failed to tokenize the prompt");
+    }
+    return tokens;
+}
+
+void BatchScheduler::admit(Slot &slot, Pending &&job) {
+    slot.job = std::move(job);
+    slot.active = true;
+    slot.response.clear();
+    slot.sent = 0;
+    slot.logits_index = -1;
+    slot.perf = {};
+    llama_sampler_reset(slot.smpl.get());
+
+    const Request &request = slot.job.request;
+    std::vector<llama_token> tokens = tokenize(format(request.system, request.prompt), true);
+    if ((int)tokens.size() >= n_ctx_slot) {
+        throw std::runtime_error("Context size exceeded");
+    }
+
+    // the evaluated system message is copied as far as the prompt starts with it
+    size_t n_common = 0;
+    if (prefix_seq >= 0) {
+        n_common = std::mismatch(prefix.begin(), prefix.end(), tokens.begin(), tokens.end()).first - prefix.begin();
+        n_common = std::min(n_common, tokens.size() - 1); // the last token is evaluated for its logits
+    }
+    llama_memory_t memory = llama_get_memory(ctx.get());
+    if (prefix_seq >= 0) {
+        n_common = std::min<size_t>(n_common, llama_memory_seq_pos_max(memory, prefix_seq) + 1);
+    }
+    llama_memory_seq_rm(memory, slot.seq, -1, -1);
+    if (n_common > 0) {
+        llama_memory_seq_cp(memory, prefix_seq, slot.seq, 0, n_common);
+    }
+    slot.n_past = n_common;
+    slot.queued.assign(tokens.begin() + n_common, tokens.end());
+    slot.perf.prompt_tokens = slot.queued.size();
+}
+
+bool BatchScheduler::advance(Slot &slot) {
+    const Request &request = slot.job.request;
+    Model::PerfStats &perf = slot.perf;
+    bool stopped = false;
+
+    // pass on the response up to the given length, ending on a complete UTF-8 character
+    auto send = [&](size_t n_ready) {
+        if (!request.onPiece || n_ready <= slot.sent) {
+            return true;
+        }
+        size_t complete = Model::utf8CompleteLength(slot.response.substr(slot.sent, n_ready - slot.sent));
+        if (complete == 0) {
+            return true;
+        }
+        bool keepGoing = request.onPiece(slot.response.substr(slot.sent, complete));
+        slot.sent += complete;
+        return keepGoing;
+    };
+    auto append = [&](const std::string &piece) {
+        slot.response += piece;
+        size_t n_hold = Model::matchStop(slot.response, piece.size(), request.stop, stopped);
+        bool keepGoing = send(slot.response.size() - n_hold);
+        return keepGoing && !stopped && (request.max_tokens <= 0 || perf.generated_tokens < request.max_tokens);
+    };
+    auto emit = [&](llama_token token) {
+        char buf[256];
+        int n = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, true);
+        if (n < 0) {
+            throw std::runtime_error("Failed to convert token to piece");
+        }
+        if (perf.generated_tokens++ == 0) {
+            perf.ttft_ms = std::chrono::duration<double, std::milli>(clock::now() - slot.job.submitted).count();
+        }
+        return append(std::string(buf, n));
+    };
+
+    clock::time_point sample_start = clock::now();
+    llama_token token = llama_sampler_sample(slot.smpl.get(), ctx.get(), slot.logits_index);
+    perf.sample_ms += std::chrono::duration<double, std::milli>(clock::now() - sample_start).count();
+    if (llama_vocab_is_eog(vocab, token) || !emit(token)) {
+        return false;
+    }
+    slot.queued = {token};
+
+    // text the response has to continue with is not sampled
+    if (request.completion_hook) {
+        Model::Completion completion = request.completion_hook(slot.response);
+        if (completion.complete) {
+            // nothing is generated after the response, so the rest is never evaluated
+            // it still counts against the token limit like the sampled tokens
+            for (llama_token forced : tokenize(completion.text, false)) {
+                if (!emit(forced)) {
+                    break;
+                }
+            }
+            return false;
+        }
+        if (!completion.text.empty()) {
+            for (llama_token forced : tokenize(completion.text, false)) {
+                llama_sampler_accept(slot.smpl.get(), forced);
+                slot.queued.push_back(forced);
+                if (!emit(forced)) {
+                    return false;
+                }
+            }
+        }
+    }
+    if (slot.n_past + (llama_pos)slot.queued.size() > n_ctx_slot) {
+        throw std::runtime_error("Context size exceeded");
+    }
+    return true;
+}
+
+void BatchScheduler::finish(Slot &slot) {
+    Model::TokenCallback &onPiece = slot.job.request.onPiece;
+    if (onPiece && slot.sent < slot.response.size()) {
+        onPiece(slot.response.substr(slot.sent));
+    }
+    slot.perf.total_ms = std::chrono::duration<double, std::milli>(clock::now() - slot.job.submitted).count();
+    slot.job.result.set_value({slot.response, slot.perf});
+    release(slot);
+}
+
+void BatchScheduler::fail(Slot &slot, const std::string &error) {
+    slot.job.result.set_exception(std::make_exception_ptr(std::runtime_error(error)));
+    release(slot);
+}
+
+void BatchScheduler::release(Slot &slot) {
+    llama_memory_seq_rm(llama_get_memory(ctx.get()), slot.seq, -1, -1);
+    slot.job = Pending();
+    slot.queued.clear();
+    std::lock_guard<std::mutex> lock(mtx);
+    slot.active = false;
+}
+
+void BatchScheduler::run() {
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+    size_t first = 0; // slot that fills the batch first, rotated so long prompts do not starve the others
+
+    while (true) {
+        // the context mutex was released with the last step, requests waiting for it get a chance to submit
+        std::this_thread::yield();
+
+        // new requests join between two steps of the running ones
+        std::vector<std::pair<Slot*, Pending>> admitted;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            auto anyActive = [this]() {
+                return std::any_of(slots.begin(), slots.end(), [](const Slot &slot) { return slot.active; });
+            };
+            cv.wait(lock, [&]() { return stop || !queue.empty() || anyActive(); });
+            if (stop) break;
+            for (Slot &slot : slots) {
+                if (!slot.active && !queue.empty()) {
+                    admitted.emplace_back(&slot, std::move(queue.front()));
+                    queue.pop_front();
+                    slot.active = true;
+                }
+            }
+        }
+
+        // the model may evaluate, unload or reload the context between two steps
+        std::lock_guard<std::recursive_mutex> ctxLock(*ctx_mutex);
+        for (auto &[slot, job] : admitted) {
+            try {
+                admit(*slot, std::move(job));
+                if (isVerbose) std::cout << "Batching request in sequence " << slot->seq << std::endl;
+            } catch (const std::exception &e) {
+                fail(*slot, e.what());
+            }
+        }
+
+        // every active slot contributes its queued tokens, prompts are split over steps when they exceed the batch
+        batch.n_tokens = 0;
+        std::vector<Slot*> batched;
+        for (size_t k = 0; k < slots.size() && batch.n_tokens < n_batch; k++) {
+            Slot &slot = slots[(first + k) % slots.size()];
+            slot.logits_index = -1;
+            if (!slot.active || slot.queued.empty()) continue;
+            int n = std::min((int)slot.queued.size(), n_batch - batch.n_tokens);
+            for (int i = 0; i < n; i++) {
+                int j = batch.n_tokens++;
+                batch.token[j] = slot.queued[i];
+                batch.pos[j] = slot.n_past + i;
+                batch.n_seq_id[j] = 1;
+                batch.seq_id[j][0] = slot.seq;
+                batch.logits[j] = false;
+            }
+            if (n == (int)slot.queued.size()) {
+                // logits of the last token sample the next one
+                slot.logits_index = batch.n_tokens - 1;
+                batch.logits[slot.logits_index] = true;
+            }
+            slot.n_past += n;
+            slot.queued.erase(slot.queued.begin(), slot.queued.begin() + n);
+            batched.push_back(&slot);
+        }
+        first = (first + 1) % slots.size();
+        if (batched.empty()) continue;
+
+        clock::time_point decode_start = clock::now();
+        if (llama_decode(ctx.get(), batch) != 0) {
+            for (Slot *slot : batched) {
+                fail(*slot, "Failed to decode the batch");
+            }
+            continue;
+        }
+        llama_synchronize(ctx.get()); // decoding may still run on the backend
+        double decode_ms = std::chrono::duration<double, std::milli>(clock::now() - decode_start).count();
+        for (Slot *slot : batched) {
+            // until the first token is sampled the slot evaluates its prompt
+            (slot->perf.generated_tokens == 0 ? slot->perf.prefill_ms : slot->perf.decode_ms) += decode_ms;
+            if (slot->logits_index < 0) continue;
+            try {
+                if (!advance(*slot)) {
+                    finish(*slot);
+                }
+            } catch (const std::exception &e) {
+                fail(*slot, e.what());
+            }
+        }
+    }
+    llama_batch_free(batch);
+
+    // requests that did not finish get an error instead of waiting forever
+    // the context is not touched, the model may be freeing it while holding the context mutex
+    std::lock_guard<std::mutex> lock(mtx);
+    for (Slot &slot : slots) {
+        if (slot.active) {
+            slot.job.result.set_exception(std::make_exception_ptr(std::runtime_error("Batch scheduler is stopped")));
+            slot.active = false;
+        }
+    }
+    for (Pending &job : queue) {
+        job.result.set_exception(std::make_exception_ptr(std::runtime_error("Batch scheduler is stopped")));
+    }
+    queue.clear();
+}
@@ -0,0 +1,142 @@
+#ifndef BATCHSCHEDULER_H
+#define BATCHSCHEDULER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <future>
+#include <functional>
+#include <chrono>
+#include <iostream>
+
+#include "llama.h"
+#include "model.h"
+
+/*
+    Generates the responses of concurrent requests together, every sequence advances in one batch per decode call.
+    A request is admitted as soon as a slot is free, between steps of the ones already running.
+    Requests are stateless: a system message and one user message. The evaluated system message is copied into each slot.
+    The context belongs to the Model, the scheduler decodes in it while holding the context mutex.
+    std::shared_ptr<llama_model> model          || Weights, for the vocabulary and the chat template
+    std::shared_ptr<llama_context> ctx          || Context with one sequence per slot, slot i uses sequence i
+    std::shared_ptr<std::recursive_mutex> mtx   || Mutex guarding the context
+    int slots                                   || Requests generated at once
+    int n_ctx                                   || Context size of each slot
+    SamplerFactory createSampler                || Builds the sampler chain of a slot, it is called once per slot
+*/
+class BatchScheduler {
+public:
+    using SamplerFactory = std::function<llama_sampler*()>;
+
+    struct Request {
+        std::string system; // system message
+        std::string prompt; // user message
+        int max_tokens = 0; // generated tokens, 0 for no limit
+        std::vector<std::string> stop; // strings that end the response
+        Model::TokenCallback onPiece; // called on the scheduler thread, nullptr to only return the response
+        Model::CompletionHook completion_hook; // empty to always sample
+    };
+
+    struct Result {
+        std::string response;
+        Model::PerfStats perf; // decode calls are shared, each request is charged the full time of the calls it took part in
+    };
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct LlamaSamplerDeleter {
+        void operator()(llama_sampler* s) const {
+            if (s) llama_sampler_free(s);
+        }
+    };
+
+    struct Pending {
+        Request request;
+        std::promise<Result> result;
+        clock::time_point submitted;
+    };
+
+    struct Slot {
+        llama_seq_id seq = 0;
+        bool active = false;
+        std::unique_ptr<llama_sampler, LlamaSamplerDeleter> smpl;
+        Pending job;
+        std::vector<llama_token> queued; // tokens waiting to be evaluated: the prompt, then each sampled token
+        llama_pos n_past = 0; // tokens of the sequence in the context
+        int logits_index = -1; // position of the slot's logits in the current batch, -1 if it has none
+        std::string response;
+        size_t sent = 0; // bytes of the response passed to the callback
+        Model::PerfStats perf;
+    };
+
+    std::shared_ptr<llama_model> model;
+    std::shared_ptr<llama_context> ctx;
+    std::shared_ptr<std::recursive_mutex> ctx_mutex;
+    const llama_vocab *vocab = nullptr; // managed by llama.cpp
+    int n_ctx_slot = 0; // context size of each slot
+    int n_batch = 0; // tokens per decode call
+    bool isVerbose = false;
+
+    std::vector<Slot> slots;
+    llama_seq_id prefix_seq = -1; // sequence holding the evaluated system message, -1 if there is none
+    std::vector<llama_token> prefix; // tokens of the system message in prefix_seq
+
+    std::deque<Pending> queue;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stop = false;
+    std::thread worker;
+
+    // Applies the chat template of the model
+    std::string format(const std::string &system, const std::string &prompt) const;
+    std::vector<llama_token> tokenize(const std::string &text, const bool add_special) const;
+    // Starts a request in a free slot, reusing the evaluated system message
+    void admit(Slot &slot, Pending &&job);
+    // Samples the next token of a slot after a decode call, returns false once the response is finished
+    bool advance(Slot &slot);
+    // Fulfils the request of a slot and frees its sequence
+    void finish(Slot &slot);
+    void fail(Slot &slot, const std::string &error);
+    // Clears the sequence of a slot so it can be admitted again
+    void release(Slot &slot);
+    // Admits requests and decodes all active slots together until the scheduler stops
+    void run();
+
+public:
+    BatchScheduler(std::shared_ptr<llama_model> model, std::shared_ptr<llama_context> ctx, std::shared_ptr<std::recursive_mutex> mtx,
+                   const int slots, const int n_ctx, const SamplerFactory &createSampler, const bool isVerbose);
+    BatchScheduler(const BatchScheduler&) = delete;
+    BatchScheduler& operator=(const BatchScheduler&) = delete;
+    /*
+        Stops the scheduler, requests that did not finish fail.
+    */
+    ~BatchScheduler();
+
+    /*
+        Queues a request, it can be called from any thread.
+        Request request       || System and user message with the limits of the response
+        returns               || Response and its timings, an exception if it failed
+    */
+    std::future<Result> submit(Request request);
+    /*
+        Sets the evaluated system message the slots copy, called while holding the context mutex.
+        llama_seq_id seq                        || Sequence holding it, outside the slots
+        std::vector<llama_token> &tokens        || Tokens of the sequence
+    */
+    void setPrefix(const llama_seq_id seq, const std::vector<llama_token> &tokens);
+    /*
+        Whether a request is queued or generating, called while holding the context mutex.
+    */
+    bool busy();
+
+    int getSlots() const { return (int)slots.size(); }
+    int getContextSize() const { return n_ctx_slot; }
+    size_t getQueued();
+};
+
+#endif
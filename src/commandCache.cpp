@@ -0,0 +1,171 @@
+#include "commandCache.h"
+#include "configVars.h"
+#include "nlohmann/json.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <filesystem>
+
+using json = nlohmann::json;
+
+CommandCache::CommandCache(const size_t capacity, const std::string& path, const bool isVerbose)
+    : capacity(capacity), path(path), isVerbose(isVerbose) {}
+
+std::string CommandCache::normalize(const std::string& utterance) {
+    // the filler words the parser skips do not change the command either
+    std::string normalized;
+    for (const auto& word : FunctionCall::cleanWords(utterance, true)) {
+        if (!normalized.empty()) normalized += " ";
+        normalized += word;
+    }
+    return normalized;
+}
+
+uint64_t CommandCache::catalogHash(const std::vector<ConfigVars::Commands>& commands) {
+    // FNV-1a, the hash is stored in the cache file
+    uint64_t hash = 14695981039346656037ull;
+    auto add = [&hash](const std::string& data) {
+        for (unsigned char c : data) {
+            hash ^= c;
+            hash *= 1099511628211ull;
+        }
+        hash ^= 0xff; // separator between fields
+        hash *= 1099511628211ull;
+    };
+    for (const auto& cmd : commands) {
+        add(cmd.name);
+        add(cmd.function);
+        add(std::to_string(cmd.NArgs));
+        add(std::to_string(cmd.priority)); // decides which command parsePhrase resolves
+        for (const auto& phrase : cmd.phrases) {
+            add(phrase);
+        }
+    }
+    return hash;
+}
+
+void CommandCache::load(const std::vector<ConfigVars::Commands>& commands) {
+    std::lock_guard<std::mutex> lock(mtx);
+    catalog = catalogHash(commands);
+    items.clear();
+    index.clear();
+    if (path.empty()) return;
+
+    std::ifstream file(path);
+    if (!file) return;
+    json cache = json::parse(file, nullptr, false);
+    if (cache.is_discarded() || !cache.is_object()) {
+        std::cerr << "Ignoring unreadable command cache " << path << std::endl;
+        return;
+    }
+    if (cache.value("catalog", std::string()) != std::to_string(catalog)) {
+        if (isVerbose) std::cout << "Commands changed, discarding the command cache" << std::endl;
+        return;
+    }
+    // the file lists the entries from most to least recently used
+    for (const auto& item : cache.value("entries", json::array())) {
+        Entry entry;
+        entry.output = item.value("output", "");
+        entry.parsed.command = item.value("command", "");
+        entry.parsed.arguments = item.value("arguments", std::vector<std::string>());
+        std::string key = item.value("utterance", "");
+        if (key.empty() || entry.parsed.command.empty() || index.count(key)) continue;
+        items.push_back({key, entry});
+        index[key] = std::prev(items.end());
+    }
+    evict();
+    if (isVerbose) std::cout << "Loaded " << items.size() << " cached commands" << std::endl;
+}
+
+std::optional<CommandCache::Entry> CommandCache::get(const std::string& utterance) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = index.find(normalize(utterance));
+    if (it == index.end()) {
+        return std::nullopt;
+    }
+    items.splice(items.begin(), items, it->second);
+    return it->second->second;
+}
+
+void CommandCache::put(const std::string& utterance, const std::string& output, const FunctionCall::ParsedPhrase& parsed) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (capacity == 0) return;
+    std::string key = normalize(utterance);
+    if (key.empty()) return;
+
+    auto it = index.find(key);
+    if (it != index.end()) {
+        it->second->second = {output, parsed};
+        items.splice(items.begin(), items, it->second);
+    } else {
+        items.push_front({key, {output, parsed}});
+        index[key] = items.begin();
+        evict();
+    }
+    write();
+}
+
+void CommandCache::clear() {
+    std::lock_guard<std::mutex> lock(mtx);
+    items.clear();
+    index.clear();
+    if (!path.empty()) {
+        std::error_code ec;
+        std::filesystem::remove(path, ec);
+    }
+}
+
+size_t CommandCache::size() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return items.size();
+}
+
+void CommandCache::setCapacity(const size_t cap) {
+    std::lock_guard<std::mutex> lock(mtx);
+    capacity = cap;
+    evict();
+}
+
+void CommandCache::evict() {
+    while (items.size() > capacity) {
+        index.erase(items.back().first);
+        items.pop_back();
+    }
+}
+
+void CommandCache::write() const {
+    if (path.empty()) return;
+
+    json entries = json::array();
+    for (const auto& [key, entry] : items) {
+        entries.push_back({
+            {"utterance", key},
+            {"output", entry.output},
+            {"command", entry.parsed.command},
+            {"arguments", entry.parsed.arguments}
+        });
+    }
+    // the hash is kept as a string, JSON readers may round large numbers
+    json cache = {{"catalog", std::to_string(catalog)}, {"entries", entries}};
+
+    // a cut off write must not leave a broken cache behind
+    std::error_code ec;
+    std::filesystem::path file(path);
+    if (file.has_parent_path()) {
+        std::filesystem::create_directories(file.parent_path(), ec);
+    }
+    std::filesystem::path tmp = file;
+    tmp += ".tmp";
+    {
+        std::ofstream out(tmp);
+        if (!out) {
+            std::cerr << "Failed to write the command cache " << path << std::endl;
+            return;
+        }
+        out << cache.dump(4) << std::endl;
+    }
+    std::filesystem::rename(tmp, file, ec);
+    if (ec) {
+        std::cerr << "Failed to write the command cache " << path << ": " << ec.message() << std::endl;
+    }
+}
@@ -0,0 +1,97 @@
+#ifndef COMMANDCACHE_H
+#define COMMANDCACHE_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <optional>
+#include <mutex>
+#include <cstdint>
+#include <iostream>
+
+#include "functionCall.h"
+
+/*
+    Remembers what the command model made of an utterance, so a repeated utterance skips the model.
+    Least recently used entries are dropped once the cache is full.
+    The cache is kept in a JSON file and discarded when the configured commands change.
+    size_t capacity                 || Maximum number of utterances, 0 disables the cache
+    std::string path                || File the cache is kept in, empty to keep it in memory only
+*/
+class CommandCache {
+public:
+    struct Entry {
+        std::string output; // response of the command model
+        FunctionCall::ParsedPhrase parsed; // command the response was parsed into
+    };
+
+private:
+    using Item = std::pair<std::string, Entry>; // normalized utterance and its entry
+
+    size_t capacity = 256;
+    std::string path;
+    bool isVerbose = false;
+    uint64_t catalog = 0; // hash of the commands the entries were parsed with
+
+    std::list<Item> items; // most recently used first
+    std::unordered_map<std::string, std::list<Item>::iterator> index;
+    mutable std::mutex mtx;
+
+    // Drops the least recently used entries above the capacity
+    void evict();
+    // Writes the cache to its file, the mutex is held by the caller
+    void write() const;
+
+public:
+    CommandCache() = default;
+    CommandCache(const size_t capacity, const std::string& path, const bool isVerbose);
+    CommandCache(const CommandCache&) = delete;
+    CommandCache& operator=(const CommandCache&) = delete;
+
+    /*
+        Reads the cache file, entries of a different command catalog are discarded.
+        const std::vector<ConfigVars::Commands>& commands   || List of available commands
+    */
+    void load(const std::vector<ConfigVars::Commands>& commands);
+    /*
+        Looks up an utterance and marks it as recently used.
+        const std::string& utterance    || User input
+        returns                         || Cached entry, empty if the utterance is not cached
+    */
+    std::optional<Entry> get(const std::string& utterance);
+    /*
+        Stores what the command model made of an utterance and writes the cache file.
+        const std::string& utterance            || User input
+        const std::string& output               || Response of the command model
+        const FunctionCall::ParsedPhrase& parsed || Command the response was parsed into
+    */
+    void put(const std::string& utterance, const std::string& output, const FunctionCall::ParsedPhrase& parsed);
+    /*
+        Removes every entry, the file as well.
+    */
+    void clear();
+    /*
+        Key of an utterance: lower case, without the ignored symbols and with single spaces.
+        const std::string& utterance    || User input
+    */
+    static std::string normalize(const std::string& utterance);
+    /*
+        Hash of the commands that is stable across builds, any change to names, functions, arguments, priorities or phrases changes it.
+        const std::vector<ConfigVars::Commands>& commands   || List of available commands
+    */
+    static uint64_t catalogHash(const std::vector<ConfigVars::Commands>& commands);
+
+    size_t size() const;
+
+    // Setters and Getters
+    void setCapacity(const size_t cap);
+    void setPath(const std::string& file) { path = file; }
+    void setVerbose(const bool vb) { isVerbose = vb; }
+
+    size_t getCapacity() const { return capacity; }
+    const std::string& getPath() const { return path; }
+    bool getVerbose() const { return isVerbose; }
+};
+
+#endif
@@ -156,7 +156,7 @@ void FunctionCall::initCommands(const ConfigVars::config& config, MQTTClient* mq
         if (isVerbose) std::cout << "Pushing chat command" << std::endl;
         commandList.push_back({
             "chat", 1, {"String"}, model,
-            [model, isVerbose](const std::vector<std::string>& args) -> std::string {
+            [model, voice, isVerbose](const std::vector<std::string>& args) -> std::string {
                 std::string response = "";
                 if (isVerbose) std::cout << "Running chat with user prompt: " << args[0] << std::endl;
                 if (args.empty()) {
@@ -164,13 +164,32 @@ void FunctionCall::initCommands(const ConfigVars::config& config, MQTTClient* mq
                 }
                 try {
                     if (isVerbose) std::cout << "Generating response from model..." << std::endl;
+                    if (voice && voice->isInitialized()) {
+                        // speak each sentence as soon as it is generated
+                        SentenceSplitter splitter;
+                        voice->startStream();
+                        try {
+                            response = model->respond(args[0], [voice, &splitter](const std::string& piece) {
+                                for (const auto& sentence : splitter.push(piece)) {
+                                    voice->queueSentence(sentence);
+                                }
+                                return true;
+                            });
+                            voice->queueSentence(splitter.flush());
+                        } catch (const std::exception &e) {
+                            voice->finishStream();
+                            throw;
+                        }
+                        voice->finishStream();
+                    } else {
                         response = model->respond(args[0]);
+                    }
                 } catch (const std::exception &e) {
                     std::cerr << "Error generating response from model: " << e.what() << std::endl;
                     return "Error generating response from model: " + std::string(e.what());
                 }
                 return response;
-            }
+            }, true, true
         });
     }
 
@@ -34,6 +34,7 @@ void ConfigReader::parseConfig() {
     } else {
         config.ModelEnable = false; // Default to false if not specified
     }
+    config.memoryBudget = configJson.value("memoryBudget", 0);
     for (const auto& modelJson : configJson["models"]) {
         if (!modelJson.is_object())
             throw std::runtime_error("Model entry is not an object");
@@ -51,6 +52,38 @@ void ConfigReader::parseConfig() {
         model.top_k = modelJson.value("top_k", 40);
         model.init_message = modelJson.value("init_message", "You are a helpful assistant.");
         model.keepHistory = modelJson.value("keepHistory", false);
+        model.cache_dir = modelJson.value("cache_dir", "");
+        model.context_group = modelJson.value("context_group", "");
+        model.grammar = modelJson.value("grammar", false);
+        model.complete_phrases = modelJson.value("complete_phrases", false);
+        model.draft_path = modelJson.value("draft_path", "");
+        model.n_draft = modelJson.value("n_draft", 8);
+        model.lookup_ngram = modelJson.value("lookup_ngram", 0);
+        model.context_policy = modelJson.value("context_policy", "none");
+        model.summary_budget = modelJson.value("summary_budget", 0);
+        model.summary_idle = modelJson.value("summary_idle", 60);
+        model.max_tokens = modelJson.value("max_tokens", 0);
+        model.stop = modelJson.value("stop", std::vector<std::string>{});
+        // batch and thread settings are a number, or "auto" to benchmark them at startup
+        auto tuning = [&modelJson](const std::string& key) {
+            if (modelJson.contains(key) && modelJson[key].is_string() && modelJson[key] == "auto")
+                return -1;
+            return modelJson.value(key, 0);
+        };
+        model.n_batch = tuning("n_batch");
+        model.n_ubatch = tuning("n_ubatch");
+        model.n_threads = tuning("n_threads");
+        model.n_threads_batch = tuning("n_threads_batch");
+        model.type_k = modelJson.value("type_k", "f16");
+        model.type_v = modelJson.value("type_v", "f16");
+        model.flash_attn = modelJson.value("flash_attn", "auto");
+        model.idle_unload = modelJson.value("idle_unload", 0);
+        model.unload_weights = modelJson.value("unload_weights", false);
+        model.perf_log = modelJson.value("perf_log", "");
+        model.session_file = modelJson.value("session_file", "");
+        model.session_interval = modelJson.value("session_interval", 0);
+        model.sessions = modelJson.value("sessions", 1);
+        model.parallel = modelJson.value("parallel", 1);
         if (modelJson["dist"].is_string() && modelJson["dist"] == "default")
             model.dist = LLAMA_DEFAULT_SEED; // Set default distribution if specified
         else
@@ -133,6 +166,29 @@ void ConfigReader::parseConfig() {
     } else {
         throw std::runtime_error("Config JSON does not contain 'voice' object");
     }
+    // Embedding matcher between the phrase patterns and the command model, off unless configured
+    config.intentMatcher.enabled = false;
+    if (configJson.contains("intentMatcher") && configJson["intentMatcher"].is_object()) {
+        const auto& matcherJson = configJson["intentMatcher"];
+
+        config.intentMatcher.enabled = matcherJson.value("enabled", false);
+        config.intentMatcher.model_path = matcherJson.value("model_path", "");
+        config.intentMatcher.ngl = matcherJson.value("ngl", 0);
+        config.intentMatcher.threshold = matcherJson.value("threshold", 0.8f);
+        config.intentMatcher.margin = matcherJson.value("margin", 0.05f);
+    }
+    // Cache of the command model responses, off unless configured
+    config.commandCache.enabled = false;
+    if (configJson.contains("commandCache") && configJson["commandCache"].is_object()) {
+        const auto& cacheJson = configJson["commandCache"];
+
+        config.commandCache.enabled = cacheJson.value("enabled", false);
+        config.commandCache.capacity = cacheJson.value("capacity", 256);
+        config.commandCache.path = cacheJson.value("path", "cache/commands.json");
+        if (config.commandCache.capacity < 0) {
+            throw std::invalid_argument("commandCache capacity must not be negative");
+        }
+    }
 }
 
 
@@ -16,6 +16,32 @@ namespace ConfigVars {
         float dist;
         std::string init_message;
         bool keepHistory;
+        std::string cache_dir;
+        std::string context_group;
+        bool grammar;
+        bool complete_phrases;
+        std::string draft_path;
+        int n_draft;
+        int lookup_ngram;
+        std::string context_policy;
+        int summary_budget;
+        int summary_idle;
+        int max_tokens;
+        std::vector<std::string> stop;
+        int n_batch; // -1 for "auto"
+        int n_ubatch;
+        int n_threads;
+        int n_threads_batch;
+        std::string type_k;
+        std::string type_v;
+        std::string flash_attn;
+        int idle_unload;
+        bool unload_weights;
+        std::string perf_log;
+        std::string session_file;
+        int session_interval;
+        int sessions;
+        int parallel;
     };
 
     struct MQTTCommand {
@@ -62,13 +88,30 @@ namespace ConfigVars {
         float noise_w_scale;
     };
     
+    struct IntentMatcherConfig {
+        bool enabled;
+        std::string model_path; // empty to use the weights of the command model
+        int ngl;
+        float threshold; // minimum cosine similarity to run a command without the command model
+        float margin; // minimum lead over the closest phrase of another command
+    };
+    
+    struct CommandCacheConfig {
+        bool enabled;
+        int capacity; // utterances kept, least recently used ones are dropped
+        std::string path; // file the cache is kept in across restarts
+    };
+    
     // Overall configuration structure
     struct config {
         bool ModelEnable;
+        int memoryBudget; // MiB all models may use together, 0 for no budget
         std::vector<Model> models;
         MQTTConfig mqtt;
         std::vector<Commands> commandCalls;
         VoiceConfig voice;
+        IntentMatcherConfig intentMatcher;
+        CommandCacheConfig commandCache;
     };
 };
 
@@ -5,6 +5,9 @@
 #include "mqtt.h"
 #include "configReader.h"
 
+#include <set>
+#include <tuple>
+
 using json = nlohmann::json;
 using namespace nlohmann::literals;
 
@@ -66,6 +69,41 @@ std::string FunctionCall::call(const std::unique_ptr<FunctionCall::ParsedPhrase>
 }
 
 
+bool FunctionCall::speaksResponse(const std::string& command) {
+    for (const auto& cmd : commandList) {
+        if (cmd.command == command) return cmd.speaksResponse;
+    }
+    return false;
+}
+
+
+bool FunctionCall::needsModel(const std::string& command) {
+    for (const auto& cmd : commandList) {
+        if (cmd.command == command) return cmd.needsModel;
+    }
+    return false;
+}
+
+
+std::vector<std::string> FunctionCall::cleanWords(const std::string& phrase, const bool dropIgnored) {
+    std::string lower = phrase;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    std::istringstream iss(lower);
+    std::vector<std::string> words;
+    std::string w;
+    while (iss >> w) {
+        for (const auto& sym : ignoreSymbols) {
+            size_t p;
+            while ((p = w.find(sym)) != std::string::npos) w.erase(p, sym.size());
+        }
+        if (dropIgnored && std::find(ignorePatterns.begin(), ignorePatterns.end(), w) != ignorePatterns.end()) {
+            continue;
+        }
+        if (!w.empty()) words.push_back(w);
+    }
+    return words;
+}
+
 bool FunctionCall::parsePhrase(const std::string phrase, std::unique_ptr<FunctionCall::ParsedPhrase>& outParsed, const std::vector<ConfigVars::Commands>& commands, const bool isVerbose) {
     auto toLower = [](std::string s){
         std::transform(s.begin(), s.end(), s.begin(), ::tolower);
@@ -97,18 +135,7 @@ bool FunctionCall::parsePhrase(const std::string phrase, std::unique_ptr<Functio
             }
 
             // Tokenize and clean phrase according to pattern rules
-            std::string lowerPhrase = toLower(phrase);
-            std::vector<std::string> phraseWords;
-            for (auto w : splitWords(lowerPhrase)) {
-                for (const auto& sym : ignoreSymbols) {
-                    size_t p;
-                    while ((p = w.find(sym)) != std::string::npos) w.erase(p, 1);
-                }
-                if (!patternHasRest && std::find(ignorePatterns.begin(), ignorePatterns.end(), w) != ignorePatterns.end()) {
-                    continue;
-                }
-                if (!w.empty()) phraseWords.push_back(w);
-            }
+            std::vector<std::string> phraseWords = cleanWords(phrase, !patternHasRest);
 
             if (!patternHasRest && (phraseWords.size() != patternWords.size())) {
                 if (isVerbose) std::cout << "Phrase shorter than pattern, skipping\n";
@@ -195,3 +222,165 @@ bool FunctionCall::parsePhrase(const std::string phrase, std::unique_ptr<Functio
     outParsed = nullptr;
     return false;
 }
+
+
+// Split a pattern into literal text and argument slots, argument placeholders become free words, "->" takes the rest of the phrase
+std::vector<FunctionCall::PatternPart> FunctionCall::splitPattern(const std::string& pattern) {
+    std::vector<PatternPart> parts;
+    std::istringstream iss(pattern);
+    std::string word, text;
+    bool first = true;
+    while (iss >> word) {
+        if (!first) text += " ";
+        first = false;
+        if (word.find("<arg") != std::string::npos) {
+            if (!text.empty()) parts.push_back({PatternPart::Literal, text});
+            text.clear();
+            bool rest = word.size() >= 2 && word.substr(word.size() - 2) == "->";
+            parts.push_back({rest ? PatternPart::Rest : PatternPart::Word, ""});
+        } else {
+            text += word;
+        }
+    }
+    if (!text.empty()) parts.push_back({PatternPart::Literal, text});
+    return parts;
+}
+
+
+std::string FunctionCall::buildGrammar(const std::vector<ConfigVars::Commands>& commands, const std::string& fallback) {
+    auto literal = [](const std::string &text) {
+        std::string escaped = "\"";
+        for (char c : text) {
+            if (c == '"' || c == '\\') escaped += '\\';
+            escaped += c;
+        }
+        return escaped + "\"";
+    };
+
+    std::vector<std::string> alternatives;
+    for (const auto& cmd : commands) {
+        for (const auto& pattern : cmd.phrases) {
+            std::string rule;
+            for (const auto& part : splitPattern(pattern)) {
+                if (!rule.empty()) rule += " ";
+                if (part.kind == PatternPart::Literal) rule += literal(part.text);
+                else rule += part.kind == PatternPart::Rest ? "rest" : "word";
+            }
+            if (!rule.empty() && std::find(alternatives.begin(), alternatives.end(), rule) == alternatives.end()) {
+                alternatives.push_back(rule);
+            }
+        }
+    }
+    if (!fallback.empty()) {
+        alternatives.push_back(literal(fallback));
+    }
+    if (alternatives.empty()) {
+        throw std::invalid_argument("No phrases to build a grammar from");
+    }
+
+    std::string grammar = "root ::= ";
+    for (size_t i = 0; i < alternatives.size(); ++i) {
+        if (i > 0) grammar += "\n    | ";
+        grammar += "(" + alternatives[i] + ")";
+    }
+    grammar += "\nword ::= [^ \\t\\r\\n<>]+\n";
+    grammar += "rest ::= word (\" \" word)*\n";
+    return grammar;
+}
+
+
+bool FunctionCall::completePhrase(const std::string& prefix, const std::vector<ConfigVars::Commands>& commands, const std::string& fallback, std::string& outLiteral) {
+    outLiteral.clear();
+
+    std::vector<std::vector<PatternPart>> patterns;
+    for (const auto& cmd : commands) {
+        for (const auto& pattern : cmd.phrases) patterns.push_back(splitPattern(pattern));
+    }
+    if (!fallback.empty()) patterns.push_back({{PatternPart::Literal, fallback}});
+
+    // same characters as the "word" rule of the grammar
+    auto isWordChar = [](char c) {
+        return c != ' ' && c != '\t' && c != '\r' && c != '\n' && c != '<' && c != '>';
+    };
+
+    // positions in the patterns that the prefix can end at
+    struct State {
+        size_t pattern;
+        size_t part;
+        size_t offset; // characters consumed of the part
+        bool space; // a rest argument ended on a space and needs another word
+        bool operator<(const State& other) const {
+            return std::tie(pattern, part, offset, space) < std::tie(other.pattern, other.part, other.offset, other.space);
+        }
+    };
+    // a finished part moves on to the next one without consuming characters
+    auto close = [&](std::set<State> states) {
+        std::vector<State> open(states.begin(), states.end());
+        while (!open.empty()) {
+            State state = open.back();
+            open.pop_back();
+            const auto& parts = patterns[state.pattern];
+            if (state.part >= parts.size()) continue;
+            const auto& part = parts[state.part];
+            bool done = part.kind == PatternPart::Literal ? state.offset == part.text.size() : state.offset > 0 && !state.space;
+            if (done) {
+                State next{state.pattern, state.part + 1, 0, false};
+                if (states.insert(next).second) open.push_back(next);
+            }
+        }
+        return states;
+    };
+
+    std::set<State> states;
+    for (size_t i = 0; i < patterns.size(); ++i) states.insert({i, 0, 0, false});
+    states = close(states);
+    for (char c : prefix) {
+        std::set<State> next;
+        for (const auto& state : states) {
+            const auto& parts = patterns[state.pattern];
+            if (state.part >= parts.size()) continue;
+            const auto& part = parts[state.part];
+            if (part.kind == PatternPart::Literal) {
+                if (state.offset < part.text.size() && part.text[state.offset] == c) next.insert({state.pattern, state.part, state.offset + 1, false});
+            } else if (isWordChar(c)) {
+                next.insert({state.pattern, state.part, state.offset + 1, false});
+            } else if (part.kind == PatternPart::Rest && c == ' ' && state.offset > 0 && !state.space) {
+                next.insert({state.pattern, state.part, state.offset + 1, true});
+            }
+        }
+        states = close(next);
+        if (states.empty()) return false; // the prefix does not belong to any phrase
+    }
+
+    // the continuation is only known while every matching phrase continues with the same literal text
+    std::vector<std::string> remaining;
+    bool ends = true;
+    for (const auto& state : states) {
+        const auto& parts = patterns[state.pattern];
+        if (state.part >= parts.size()) {
+            remaining.push_back("");
+            continue;
+        }
+        const auto& part = parts[state.part];
+        if (part.kind == PatternPart::Literal && state.offset == part.text.size()) continue; // the next part is a state as well
+        if (part.kind != PatternPart::Literal) return false; // an argument is still open
+        remaining.push_back(part.text.substr(state.offset));
+        if (state.part + 1 < parts.size()) ends = false;
+    }
+
+    std::string common = remaining.front();
+    for (const auto& text : remaining) {
+        size_t n = 0;
+        while (n < common.size() && n < text.size() && common[n] == text[n]) ++n;
+        common.resize(n);
+        if (text.size() != remaining.front().size()) ends = false;
+    }
+    if (ends && common == remaining.front()) {
+        outLiteral = common;
+        return true;
+    }
+    // the space in front of an argument is left to the model, it usually belongs to the argument's token
+    while (!common.empty() && common.back() == ' ') common.pop_back();
+    outLiteral = common;
+    return false;
+}
@@ -30,6 +30,14 @@ namespace FunctionCall {
         std::vector<std::string> argTypes;
         std::any cntx;
         std::function<std::string(const std::vector<std::string>&)> function;
+        bool speaksResponse = false; // the function speaks its response itself when the voice is initialized
+        bool needsModel = false; // the function uses the chat model, it has to be loaded first
+    };
+
+    // Literal text or argument slot of a phrase pattern
+    struct PatternPart {
+        enum Kind { Literal, Word, Rest } kind;
+        std::string text; // only for literal parts
     };
 
     struct ParsedPhrase {
@@ -64,6 +72,16 @@ namespace FunctionCall {
         returns                                                         || Result of the command execution as a string
     */
     std::string call(const std::unique_ptr<FunctionCall::ParsedPhrase>& ParsedCommand, ConfigVars::config& config, const bool isVerbose);
+    /* FunctionCall::speaksResponse to check if a command already spoke its response while it was generated
+        const std::string& command                                      || Command name
+        returns                                                         || true if the response must not be spoken again
+    */
+    bool speaksResponse(const std::string& command);
+    /* FunctionCall::needsModel to check if a command uses the chat model
+        const std::string& command                                      || Command name
+        returns                                                         || true if the command has to wait until the model is loaded
+    */
+    bool needsModel(const std::string& command);
     /* FunctionCall::ParsePhrase to parse a phrase into a ParsedPhrase
         const std::string phrase                                        || Input phrase to parse
         std::unique_ptr<FunctionCall::ParsedPhrase>& outParsed          || Output parsed phrase
@@ -72,6 +90,12 @@ namespace FunctionCall {
         returns                                                         || true if parsing was successful, false otherwise
     */
     bool parsePhrase(const std::string phrase, std::unique_ptr<FunctionCall::ParsedPhrase>& outParsed, const std::vector<ConfigVars::Commands>& commands, const bool isVerbose);
+    /* FunctionCall::cleanWords to split a phrase into the words parsePhrase compares
+        const std::string& phrase                                       || Input phrase
+        const bool dropIgnored                                          || Whether to drop the words of ignorePatterns
+        returns                                                         || Lowercase words without the ignored symbols
+    */
+    std::vector<std::string> cleanWords(const std::string& phrase, const bool dropIgnored);
     /* FunctionCall::CheckTypo to check if two strings are similar enough to be considered a typo
         const std::string& string1                                      || First string to compare
         const std::string& string2                                      || Second string to compare
@@ -87,6 +111,25 @@ namespace FunctionCall {
         const bool isVerbose                                            || Whether to print verbose output
     */
     void initCommands(const ConfigVars::config& config, MQTTClient* client, Model* model, Voice* voice, const bool isVerbose);
+    /* FunctionCall::buildGrammar to build a GBNF grammar that only accepts the configured phrases
+        const std::vector<ConfigVars::Commands>& commands               || List of available commands
+        const std::string& fallback                                     || Extra literal answer accepted by the grammar, empty for none
+        returns                                                         || Grammar with the rule "root"
+    */
+    std::string buildGrammar(const std::vector<ConfigVars::Commands>& commands, const std::string& fallback);
+    /* FunctionCall::splitPattern to split a phrase pattern into literal text and argument slots
+        const std::string& pattern                                      || Phrase pattern with <argN> and <argN-> placeholders
+        returns                                                         || Parts of the pattern in order
+    */
+    std::vector<PatternPart> splitPattern(const std::string& pattern);
+    /* FunctionCall::completePhrase to find the literal text every phrase starting with the prefix continues with
+        const std::string& prefix                                       || Generated start of a phrase
+        const std::vector<ConfigVars::Commands>& commands               || List of available commands
+        const std::string& fallback                                     || Extra literal answer, empty for none
+        std::string& outLiteral                                         || Text the phrase continues with, empty if it is not determined
+        returns                                                         || true if the phrase ends after outLiteral
+    */
+    bool completePhrase(const std::string& prefix, const std::vector<ConfigVars::Commands>& commands, const std::string& fallback, std::string& outLiteral);
 }
 
 #endif
@@ -0,0 +1,154 @@
+#include "intentMatcher.h"
+#include "configVars.h"
+
+#include <cmath>
+#include <regex>
+
+IntentMatcher::IntentMatcher(const std::string& modelPath, const int ngl, const float threshold, const float margin, const bool isVerbose)
+    : modelPath(modelPath), ngl(ngl), threshold(threshold), margin(margin), isVerbose(isVerbose) {}
+
+void IntentMatcher::init(const std::vector<ConfigVars::Commands>& commands) {
+    std::lock_guard<std::mutex> lock(mtx);
+    model = ModelRegistry::acquireModel(modelPath, ngl);
+    n_embd = llama_model_n_embd(model.get());
+
+    // short utterances only, the whole input is evaluated in one batch as encoders require
+    llama_context_params params = llama_context_default_params();
+    params.n_ctx = 512;
+    params.n_batch = params.n_ctx;
+    params.n_ubatch = params.n_ctx;
+    params.embeddings = true;
+    ctx.reset(llama_init_from_model(model.get(), params));
+    if (ctx && llama_pooling_type(ctx.get()) == LLAMA_POOLING_TYPE_NONE) {
+        // generative models have no pooling of their own, average over the tokens
+        params.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+        ctx.reset(llama_init_from_model(model.get(), params));
+    }
+    if (!ctx) {
+        throw std::runtime_error("Failed to create the embedding context");
+    }
+
+    // the placeholders carry no meaning, only the literal words are embedded
+    const std::regex placeholder("\\s*<arg[0-9]+-?>");
+    phrases.clear();
+    phraseEmbeddings.clear();
+    for (const auto& cmd : commands) {
+        for (const auto& pattern : cmd.phrases) {
+            std::string text = std::regex_replace(pattern, placeholder, "");
+            if (text.empty()) continue;
+            std::vector<float> embedding = embed(text);
+            phraseEmbeddings.insert(phraseEmbeddings.end(), embedding.begin(), embedding.end());
+            phrases.push_back({cmd.function, pattern, cmd.NArgs, 0.0f});
+        }
+    }
+    if (isVerbose) std::cout << "Embedded " << phrases.size() << " phrases with " << n_embd << " dimensions" << std::endl;
+}
+
+std::vector<float> IntentMatcher::embed(const std::string& text) {
+    const llama_vocab *vocab = llama_model_get_vocab(model.get());
+    int n_max = llama_n_ctx(ctx.get());
+    std::vector<llama_token> tokens(n_max);
+    int n_tokens = llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), n_max, true, false);
+    if (n_tokens < 0) {
+        // nothing is written when the buffer is too small, tokenize all of it and cut off the rest
+        tokens.resize(-n_tokens);
+        if (llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), true, false) < 0) {
+            throw std::runtime_error("Failed to tokenize: " + text);
+        }
+        n_tokens = n_max;
+    }
+    tokens.resize(n_tokens);
+
+    // every text is embedded on its own
+    llama_memory_t memory = llama_get_memory(ctx.get());
+    if (memory) {
+        llama_memory_clear(memory, true);
+    }
+    llama_batch batch = llama_batch_init(n_tokens, 0, 1);
+    for (int i = 0; i < n_tokens; i++) {
+        batch.token[i] = tokens[i];
+        batch.pos[i] = i;
+        batch.n_seq_id[i] = 1;
+        batch.seq_id[i][0] = 0;
+        batch.logits[i] = true;
+    }
+    batch.n_tokens = n_tokens;
+    int result = llama_model_has_encoder(model.get()) && !llama_model_has_decoder(model.get())
+        ? llama_encode(ctx.get(), batch)
+        : llama_decode(ctx.get(), batch);
+    llama_batch_free(batch);
+    if (result != 0) {
+        throw std::runtime_error("Failed to embed: " + text);
+    }
+
+    const float *pooled = llama_get_embeddings_seq(ctx.get(), 0);
+    if (!pooled) {
+        throw std::runtime_error("The embedding model returned no pooled embedding");
+    }
+    std::vector<float> embedding(pooled, pooled + n_embd);
+    float norm = std::sqrt(dot(embedding.data(), embedding.data(), n_embd));
+    if (norm > 0.0f) {
+        for (float &value : embedding) {
+            value /= norm;
+        }
+    }
+    return embedding;
+}
+
+float IntentMatcher::dot(const float* a, const float* b, const int n) {
+    // eight independent sums fill one AVX register, a single sum would serialize the additions
+    constexpr int lanes = 8;
+    float sums[lanes] = {0.0f};
+    int i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        for (int j = 0; j < lanes; j++) {
+            sums[j] += a[i + j] * b[i + j];
+        }
+    }
+    float sum = 0.0f;
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    for (int j = 0; j < lanes; j++) {
+        sum += sums[j];
+    }
+    return sum;
+}
+
+IntentMatcher::Match IntentMatcher::match(const std::string& utterance) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!ctx) {
+        throw std::runtime_error("Intent matcher is not initialized");
+    }
+    Match best;
+    if (phrases.empty() || utterance.empty()) {
+        return best;
+    }
+    std::vector<float> embedding = embed(utterance);
+
+    size_t bestIndex = 0;
+    std::vector<float> scores(phrases.size());
+    for (size_t i = 0; i < phrases.size(); i++) {
+        scores[i] = dot(embedding.data(), phraseEmbeddings.data() + i * n_embd, n_embd);
+        if (scores[i] > scores[bestIndex]) {
+            bestIndex = i;
+        }
+    }
+    // the closest phrase of any other command decides how clear the match is
+    float runnerUp = -1.0f;
+    for (size_t i = 0; i < phrases.size(); i++) {
+        if (phrases[i].command != phrases[bestIndex].command) {
+            runnerUp = std::max(runnerUp, scores[i]);
+        }
+    }
+
+    best = phrases[bestIndex];
+    best.score = scores[bestIndex];
+    if (isVerbose) {
+        std::cout << "Closest phrase: " << best.phrase << " (" << best.score << ", next command " << runnerUp << ")" << std::endl;
+    }
+    if (best.score < threshold || best.score - runnerUp < margin) {
+        best.command.clear();
+    }
+    return best;
+}
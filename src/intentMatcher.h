@@ -0,0 +1,102 @@
+#ifndef INTENTMATCHER_H
+#define INTENTMATCHER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <iostream>
+#include <stdexcept>
+
+#include "llama.h"
+#include "modelRegistry.h"
+
+namespace ConfigVars {
+    struct Commands;
+}
+
+/*
+    Matches an utterance to the closest configured phrase by the cosine similarity of their embeddings.
+    Sits between the pattern matching of FunctionCall and the command model, so paraphrased commands skip generation.
+    std::string modelPath           || GGUF used for the embeddings, the weights are shared with models of the same file
+    int ngl                         || Number of GPU layers of the embedding model
+    float threshold                 || Minimum similarity of a confident match
+    float margin                    || Minimum lead of the best command over the closest phrase of another command
+*/
+class IntentMatcher {
+public:
+    struct Match {
+        std::string command; // function of the matched command, empty if nothing was confident
+        std::string phrase; // matched phrase pattern
+        int NArgs = 0; // arguments the command takes
+        float score = 0.0f; // cosine similarity of the utterance and the phrase
+    };
+
+private:
+    struct LlamaContextDeleter {
+        void operator()(llama_context *ctx) const { llama_free(ctx); }
+    };
+
+    std::string modelPath;
+    int ngl = 0;
+    float threshold = 0.8f;
+    float margin = 0.05f;
+    bool isVerbose = false;
+
+    std::shared_ptr<llama_model> model;
+    std::unique_ptr<llama_context, LlamaContextDeleter> ctx;
+    int n_embd = 0;
+
+    // phrase embeddings as rows of one matrix, normalized so the dot product is the cosine similarity
+    std::vector<float> phraseEmbeddings;
+    std::vector<Match> phrases;
+    std::mutex mtx;
+
+    /*
+        Embeds the text into a vector of unit length.
+        const std::string& text     || Text to embed
+        returns                     || Embedding with n_embd values
+    */
+    std::vector<float> embed(const std::string& text);
+
+public:
+    IntentMatcher() = default;
+    IntentMatcher(const std::string& modelPath, const int ngl, const float threshold, const float margin, const bool isVerbose);
+    IntentMatcher(const IntentMatcher&) = delete;
+    IntentMatcher& operator=(const IntentMatcher&) = delete;
+
+    /*
+        Loads the embedding model and embeds every phrase of the commands.
+        const std::vector<ConfigVars::Commands>& commands   || List of available commands
+    */
+    void init(const std::vector<ConfigVars::Commands>& commands);
+    /*
+        Finds the phrase closest to the utterance.
+        const std::string& utterance    || User input
+        returns                         || Closest phrase, its command is empty if the match is below threshold or margin
+    */
+    Match match(const std::string& utterance);
+    /*
+        Dot product of two vectors, the cosine similarity of unit vectors.
+        Accumulates in independent lanes so the compiler turns the loop into SIMD instructions.
+    */
+    static float dot(const float* a, const float* b, const int n);
+
+    bool isInitialized() const { return ctx != nullptr; }
+    size_t phraseCount() const { return phrases.size(); }
+
+    // Setters and Getters
+    void setModelPath(const std::string& path) { modelPath = path; }
+    void setNGL(const int layers) { ngl = layers; }
+    void setThreshold(const float value) { threshold = value; }
+    void setMargin(const float value) { margin = value; }
+    void setVerbose(const bool vb) { isVerbose = vb; }
+
+    const std::string& getModelPath() const { return modelPath; }
+    int getNGL() const { return ngl; }
+    float getThreshold() const { return threshold; }
+    float getMargin() const { return margin; }
+    bool getVerbose() const { return isVerbose; }
+};
+
+#endif
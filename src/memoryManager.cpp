@@ -0,0 +1,148 @@
+#include "memoryManager.h"
+#include "model.h"
+
+#include <map>
+#include <vector>
+#include <algorithm>
+
+namespace {
+    struct Resident {
+        bool loaded = true;
+        uint64_t bytes = 0; // memory the model needs while it is loaded
+        std::vector<std::pair<const void*, uint64_t>> resources; // context and weights it holds, shared ones under the same key
+        std::chrono::steady_clock::time_point lastUsed = std::chrono::steady_clock::now();
+    };
+
+    // Checks the tracked models once a second, the thread ends with the program
+    struct Manager {
+        std::recursive_mutex mtx; // unloading a model reports back while the manager holds the lock
+        std::condition_variable_any cv;
+        std::map<Model*, Resident> models;
+        uint64_t budget = 0;
+        bool stop = false;
+        std::thread worker;
+
+        ~Manager() {
+            {
+                std::lock_guard<std::recursive_mutex> lock(mtx);
+                stop = true;
+            }
+            cv.notify_all();
+            if (worker.joinable()) worker.join();
+        }
+
+        // Memory held by the tracked models, a context or weights shared by several models count once
+        uint64_t measure() {
+            std::map<const void*, uint64_t> distinct;
+            for (const auto& [model, resident] : models) {
+                for (const auto& [key, bytes] : resident.resources) {
+                    distinct[key] = bytes;
+                }
+            }
+            uint64_t used = 0;
+            for (const auto& [key, bytes] : distinct) {
+                used += bytes;
+            }
+            return used;
+        }
+
+        // Whether a model later in the order holds any of the same memory
+        bool sharedWithLater(const std::vector<std::pair<std::chrono::steady_clock::time_point, Model*>>& order, const size_t i) {
+            for (const auto& [key, bytes] : models[order[i].second].resources) {
+                for (size_t j = i + 1; j < order.size(); j++) {
+                    for (const auto& [other, otherBytes] : models[order[j].second].resources) {
+                        if (other == key) return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        // Unloads the least recently used idle models until the needed memory fits, returns the memory in use
+        uint64_t fit(const uint64_t needed, const Model* keep) {
+            std::vector<std::pair<std::chrono::steady_clock::time_point, Model*>> order;
+            for (auto& [model, resident] : models) {
+                if (resident.loaded && model != keep) order.push_back({resident.lastUsed, model});
+            }
+            std::sort(order.begin(), order.end());
+            uint64_t used = measure();
+            for (size_t i = 0; i < order.size(); i++) {
+                if (budget == 0 || used + needed <= budget) break;
+                Model* model = order[i].second;
+                // a model that frees nothing on its own is only unloaded together with the others sharing its memory
+                if (model->freeableMemory() == 0 && !sharedWithLater(order, i)) continue;
+                // a model that is generating right now keeps its memory, otherwise the memory is counted again
+                if (model->unload()) used = measure();
+            }
+            return used;
+        }
+
+        void run() {
+            std::unique_lock<std::recursive_mutex> lock(mtx);
+            while (!stop) {
+                cv.wait_for(lock, std::chrono::seconds(1));
+                if (stop) break;
+
+                auto now = std::chrono::steady_clock::now();
+                for (auto& [model, resident] : models) {
+                    int idle = model->getIdleUnload();
+                    if (resident.loaded && idle > 0 && now - resident.lastUsed >= std::chrono::seconds(idle)) {
+                        model->unload();
+                    }
+                }
+                fit(0, nullptr);
+            }
+        }
+    };
+
+    Manager manager;
+}
+
+void MemoryManager::setBudget(const uint64_t bytes) {
+    std::lock_guard<std::recursive_mutex> lock(manager.mtx);
+    manager.budget = bytes;
+}
+
+uint64_t MemoryManager::getBudget() {
+    std::lock_guard<std::recursive_mutex> lock(manager.mtx);
+    return manager.budget;
+}
+
+void MemoryManager::track(Model* model) {
+    std::lock_guard<std::recursive_mutex> lock(manager.mtx);
+    manager.models[model].bytes = model->residentMemory();
+    manager.models[model].resources = model->memoryResources();
+    if (!manager.worker.joinable()) {
+        manager.worker = std::thread(&Manager::run, &manager);
+    }
+}
+
+void MemoryManager::untrack(Model* model) {
+    std::lock_guard<std::recursive_mutex> lock(manager.mtx);
+    manager.models.erase(model);
+}
+
+void MemoryManager::touch(Model* model) {
+    std::lock_guard<std::recursive_mutex> lock(manager.mtx);
+    auto it = manager.models.find(model);
+    if (it == manager.models.end()) return;
+    it->second.loaded = true;
+    it->second.bytes = model->residentMemory();
+    it->second.resources = model->memoryResources();
+    it->second.lastUsed = std::chrono::steady_clock::now();
+}
+
+void MemoryManager::reserve(Model* model) {
+    std::lock_guard<std::recursive_mutex> lock(manager.mtx);
+    auto it = manager.models.find(model);
+    if (it == manager.models.end()) return;
+    manager.fit(it->second.bytes, model);
+}
+
+void MemoryManager::released(Model* model) {
+    std::lock_guard<std::recursive_mutex> lock(manager.mtx);
+    auto it = manager.models.find(model);
+    if (it == manager.models.end()) return;
+    it->second.loaded = false;
+    it->second.resources = model->memoryResources();
+}
@@ -0,0 +1,46 @@
+#ifndef MEMORYMANAGER_H
+#define MEMORYMANAGER_H
+
+#include <cstdint>
+
+// Dummy declaration
+class Model;
+
+namespace MemoryManager {
+    /*
+        Sets the memory the tracked models may use together, idle models are unloaded to stay within it.
+        const uint64_t bytes        || Memory budget in bytes, 0 for no budget
+    */
+    void setBudget(const uint64_t bytes);
+    /*
+        Memory budget in bytes, 0 if there is none.
+    */
+    uint64_t getBudget();
+    /*
+        Starts watching a loaded model, it is unloaded after its idle_unload seconds without requests.
+        Model* model                || Model to watch
+    */
+    void track(Model* model);
+    /*
+        Stops watching a model, the model is not unloaded by the manager afterwards.
+        Model* model                || Model to forget
+    */
+    void untrack(Model* model);
+    /*
+        Records a request of the model, called while the model holds its context.
+        Model* model                || Model that is in use
+    */
+    void touch(Model* model);
+    /*
+        Makes room for a model that is about to be loaded by unloading the least recently used other models.
+        Model* model                || Model that is loaded next
+    */
+    void reserve(Model* model);
+    /*
+        Records that a model was unloaded, the memory it still holds is measured again.
+        Model* model                || Model that freed its memory
+    */
+    void released(Model* model);
+};
+
+#endif
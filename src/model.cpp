@@ -1,182 +1,1749 @@
 #include "model.h"
+#include "memoryManager.h"
+#include "batchScheduler.h"
+#include "nlohmann/json.hpp"
 
     // Initialize the model
     void Model::init() {
-        
-        // disables metadata dumping
-        llama_log_set([](ggml_log_level, const char *, void *) {}, nullptr);
+        if (context_policy != "none" && context_policy != "shift" && context_policy != "compact") {
+            throw std::invalid_argument("Unknown context policy: " + context_policy);
+        }
+        if (sessions < 1) {
+            throw std::invalid_argument("A model needs at least one session: " + std::to_string(sessions));
+        }
+        if (parallel < 1) {
+            throw std::invalid_argument("A model needs at least one parallel request: " + std::to_string(parallel));
+        }
+        if (parallel > 1 && keepHistory) {
+            throw std::invalid_argument("Parallel requests need a model without history");
+        }
+        // the slots are sequences of the model's own context, next to the one holding the system message
+        if (parallel > 1 && (!context_group.empty() || sessions > 1)) {
+            throw std::invalid_argument("Parallel requests need a context of their own with one session");
+        }
+        if (parallel > 1 && (!draft_path.empty() || lookup_ngram > 0)) {
+            throw std::invalid_argument("Parallel requests are not verified by a draft model or lookup");
+        }
 
-        // load dynamic backends
-        ggml_backend_load_all();
+        // initialize the model, weights are shared with other models using the same file
+        loadWeights();
 
-        // initialize the model
-        llama_model_params model_params = llama_model_default_params();
-        model_params.n_gpu_layers = ngl;
+        // initialize the context
+        context_params = llama_context_default_params();
+        context_params.n_ctx = n_ctx;
+        tuneBatch(context_params);
+        context_params.type_k = cacheType(type_k);
+        context_params.type_v = cacheType(type_v);
+        if (flash_attn == "on") {
+            context_params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+        } else if (flash_attn == "off") {
+            context_params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_DISABLED;
+        } else if (flash_attn == "auto") {
+            context_params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_AUTO;
+        } else {
+            throw std::invalid_argument("Unknown flash attention mode: " + flash_attn);
+        }
+        // llama.cpp can only use a quantized V cache inside the flash attention kernel
+        if (context_params.type_v != GGML_TYPE_F32 && context_params.type_v != GGML_TYPE_F16 && context_params.type_v != GGML_TYPE_BF16) {
+            if (context_params.flash_attn_type == LLAMA_FLASH_ATTN_TYPE_DISABLED) {
+                throw std::invalid_argument("A quantized V cache needs flash attention: " + type_v);
+            }
+            context_params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+        }
+        if (sessions > 1 && context_group.empty()) {
+            // one sequence of n_ctx tokens per active conversation, the system message is copied between them
+            context_params.n_ctx = n_ctx * sessions;
+            context_params.n_seq_max = sessions;
+            context_params.kv_unified = true;
+        }
+        if (parallel > 1) {
+            // one sequence of n_ctx tokens per slot, the system message is copied into them from the last one
+            context_params.n_ctx = n_ctx * (parallel + 1);
+            context_params.n_seq_max = parallel + 1;
+            context_params.kv_unified = true;
+        }
 
-        model.reset(llama_model_load_from_file(model_path.c_str(), model_params));
-        if (!model) {
-            throw std::runtime_error("Failed to load model");
+        ctx_mutex = context_group.empty() ? std::make_shared<std::recursive_mutex>() : ModelRegistry::contextMutex(context_group);
+        std::lock_guard<std::recursive_mutex> lock(*ctx_mutex);
+        createContext();
+        tuneThreads(context_params);
+
+        // the KV cache holds K and V rows of every layer for each position of the sequence
+        const llama_model *weights = model.get();
+        const int64_t n_embd_kv = (int64_t)llama_model_n_embd(weights) / llama_model_n_head(weights) * llama_model_n_head_kv(weights);
+        memory_usage.weights = llama_model_size(weights);
+        kv_bytes_per_token = llama_model_n_layer(weights) *
+                             (ggml_row_size(context_params.type_k, n_embd_kv) + ggml_row_size(context_params.type_v, n_embd_kv));
+        const int n_seqs = parallel > 1 ? parallel + 1 : sessions;
+        memory_usage.kv_cache = (uint64_t)n_seqs * contextSize() * kv_bytes_per_token;
+        if (isVerbose) {
+            std::cout << "n_batch: " << llama_n_batch(ctx.get()) << ", n_ubatch: " << llama_n_ubatch(ctx.get())
+                      << ", threads: " << threads << ", batch threads: " << threads_batch << std::endl;
+            std::cout << "Memory: weights " << memory_usage.weights / (1024 * 1024) << " MiB, KV cache "
+                      << memory_usage.kv_cache / (1024 * 1024) << " MiB (" << type_k << "/" << type_v
+                      << ", flash attention " << flash_attn << ")" << std::endl;
+        }
+
+        // add the initial system message
+        messages.push_back({"system", init_message}); 
+
+        createSampler();
+        if (!draft_path.empty()) {
+            createDraft();
+            draft_stats = {};
+        }
+
+        // continue the session of the last run, otherwise evaluate the system message once, requests continue from here
+        if (!(keepHistory && !session_file.empty() && restoreSession())) {
+            prefillSystem();
+        }
+        session_saved = std::chrono::steady_clock::now();
+
+        // summarize old turns in the background while the assistant is idle
+        if (keepHistory && summary_budget > 0) {
+            compaction = std::make_unique<Compaction>();
+            compaction->last_used = std::chrono::steady_clock::now();
+            compaction->worker = std::thread(&Model::compactionWorker, this);
         }
+
+        // unload the model while it is idle or other models need the memory
+        if (idle_unload > 0 || MemoryManager::getBudget() > 0) {
+            MemoryManager::track(this);
+        }
+    }
+
+    // Acquire the weights of the model
+    void Model::loadWeights() {
+        model = ModelRegistry::acquireModel(model_path, ngl);
         vocab = llama_model_get_vocab(model.get());
         if (!vocab) {
             throw std::runtime_error("Failed to get vocabulary from the model");
         }
+    }
 
-        // initialize the context
-        llama_context_params ctx_params = llama_context_default_params();
-        ctx_params.n_ctx = n_ctx;
-        ctx_params.n_batch = n_ctx;
-
-        ctx.reset(llama_init_from_model(model.get(), ctx_params));
-        if (!ctx) {
-            throw std::runtime_error("Failed to create context");
+    // Create the context, or join the shared context of the group
+    void Model::createContext() {
+        if (context_group.empty()) {
+            ctx.reset(llama_init_from_model(model.get(), context_params), LlamaContextDeleter());
+            if (!ctx) {
+                throw std::runtime_error("Failed to create context");
+            }
+            seq_slots.clear();
+            for (int i = 0; i < sessions; i++) {
+                seq_slots.push_back(i);
+            }
+            if (parallel > 1) {
+                // concurrent requests share decode calls in sequences 0 to parallel - 1, the model keeps the last one
+                seq_slots = {parallel};
+                scheduler = std::make_shared<BatchScheduler>(model, ctx, ctx_mutex, parallel, n_ctx, [this]() { return buildSampler(); }, isVerbose);
+            }
+        } else {
+            // the conversations are sequences in a context shared with the other models of the group
+            seq_slots.clear();
+            for (int i = 0; i < sessions; i++) {
+                llama_seq_id seq;
+                shared_ctx = ModelRegistry::acquireContext(context_group, model, context_params, seq);
+                seq_slots.push_back(seq);
+            }
+            ctx = shared_ctx->ctx;
+            if (isVerbose) std::cout << "Using " << sessions << " sequences of context group " << context_group << std::endl;
         }
+        seq_id = seq_slots.front();
+    }
 
-        // add the initial system message
-        messages.push_back({"system", init_message}); 
+    // Build the sampler chain
+    void Model::createSampler() {
+        smpl.reset(buildSampler());
+    }
 
-        // initialize the sampler
-        smpl.reset(llama_sampler_chain_init(llama_sampler_chain_default_params()));
-        llama_sampler_chain_add(smpl.get(), llama_sampler_init_min_p(min_p, 1));
-        llama_sampler_chain_add(smpl.get(), llama_sampler_init_top_p(top_p, 1));
-        llama_sampler_chain_add(smpl.get(), llama_sampler_init_typical(typical, 1));
-        llama_sampler_chain_add(smpl.get(), llama_sampler_init_temp(temp));
-        llama_sampler_chain_add(smpl.get(), llama_sampler_init_dist(dist));
-        llama_sampler_chain_add(smpl.get(), llama_sampler_init_top_k(top_k));
-        //llama_sampler_chain_add(smpl.get(), llama_sampler_init_mirostat(
+    llama_sampler *Model::buildSampler() const {
+        llama_sampler_chain_params sampler_params = llama_sampler_chain_default_params();
+        sampler_params.no_perf = false; // the sampling time is reported per generation
+        llama_sampler *chain = llama_sampler_chain_init(sampler_params);
+        if (!chain) {
+            throw std::runtime_error("Failed to initialize the sampler");
+        }
+        if (!grammar.empty()) {
+            // the grammar goes first so the other samplers only see allowed tokens
+            llama_sampler *grammar_smpl = llama_sampler_init_grammar(vocab, grammar.c_str(), "root");
+            if (!grammar_smpl) {
+                llama_sampler_free(chain);
+                throw std::runtime_error("Failed to parse the grammar");
+            }
+            llama_sampler_chain_add(chain, grammar_smpl);
+        }
+        llama_sampler_chain_add(chain, llama_sampler_init_min_p(min_p, 1));
+        llama_sampler_chain_add(chain, llama_sampler_init_top_p(top_p, 1));
+        llama_sampler_chain_add(chain, llama_sampler_init_typical(typical, 1));
+        llama_sampler_chain_add(chain, llama_sampler_init_temp(temp));
+        llama_sampler_chain_add(chain, llama_sampler_init_dist(dist));
+        llama_sampler_chain_add(chain, llama_sampler_init_top_k(top_k));
+        //llama_sampler_chain_add(chain, llama_sampler_init_mirostat(
         //    vocab->n_vocab, LLAMA_DEFAULT_SEED, 0.1f, 0.1f, 5));
+        return chain;
+    }
+
+    // Load the draft model for speculative decoding
+    void Model::createDraft() {
+        draft_model = ModelRegistry::acquireModel(draft_path, ngl);
+        const llama_vocab *draft_vocab = llama_model_get_vocab(draft_model.get());
+        if (llama_vocab_n_tokens(draft_vocab) != llama_vocab_n_tokens(vocab) ||
+            llama_vocab_bos(draft_vocab) != llama_vocab_bos(vocab) ||
+            llama_vocab_eos(draft_vocab) != llama_vocab_eos(vocab)) {
+            throw std::runtime_error("Draft model vocabulary does not match the model");
+        }
+        llama_context_params draft_params = context_params;
+        draft_params.n_ctx = n_ctx;
+        draft_params.n_seq_max = 1;
+        draft_params.n_threads = threads;
+        draft_params.n_threads_batch = threads_batch;
+        draft_ctx.reset(llama_init_from_model(draft_model.get(), draft_params), LlamaContextDeleter());
+        if (!draft_ctx) {
+            throw std::runtime_error("Failed to create draft context");
+        }
+        // the draft only proposes tokens, the most likely one is good enough
+        draft_smpl.reset(llama_sampler_init_greedy());
+        draft_tokens.clear();
+    }
+
+    // Free the context after saving the sequence, the next request loads it again
+    bool Model::unload() {
+        std::unique_lock<std::recursive_mutex> lock(*ctx_mutex, std::try_to_lock);
+        if (!lock.owns_lock() || !ctx || (scheduler && scheduler->busy())) {
+            return false;
+        }
+
+        // the other conversations are parked as well, they are loaded again once they are used
+        for (auto &[name, conv] : conversations) {
+            if (conv.seq_id >= 0) {
+                parkConversation(conv);
+            }
+        }
+
+        // the evaluated conversation is saved, so the history does not have to be decoded again
+        state_file = (std::filesystem::temp_directory_path() / ("azazel-" + std::to_string(reinterpret_cast<uintptr_t>(this)) + ".seq")).string();
+        if (seq_tokens.empty() || llama_state_seq_save_file(ctx.get(), state_file.c_str(), seq_id, seq_tokens.data(), seq_tokens.size()) == 0) {
+            state_file = "";
+        }
+
+        draft_ctx.reset();
+        draft_smpl.reset();
+        draft_tokens.clear();
+        scheduler.reset();
+        if (shared_ctx) {
+            // the shared context is freed with its last sequence
+            for (llama_seq_id seq : seq_slots) {
+                llama_memory_seq_rm(llama_get_memory(ctx.get()), seq, -1, -1);
+                ModelRegistry::releaseContext(shared_ctx, seq);
+            }
+            shared_ctx.reset();
+        }
+        ctx.reset();
+        if (unload_weights) {
+            // the sampler holds the vocabulary of the weights
+            smpl.reset();
+            vocab = nullptr;
+            draft_model.reset();
+            model.reset();
+        }
+        MemoryManager::released(this);
+        if (isVerbose) std::cout << "Unloaded " << model_name << (unload_weights ? " with its weights" : "") << std::endl;
+        return true;
+    }
+
+    // Load the model again after it was unloaded
+    void Model::ensureLoaded() {
+        if (ctx) {
+            MemoryManager::touch(this);
+            return;
+        }
+        auto begin = std::chrono::steady_clock::now();
+        MemoryManager::reserve(this);
+
+        if (!model) {
+            loadWeights();
+        }
+        createContext();
+        llama_set_n_threads(ctx.get(), threads, threads_batch);
         if (!smpl) {
-            throw std::runtime_error("Failed to initialize the sampler");
+            createSampler();
+        }
+        if (!draft_path.empty()) {
+            createDraft();
+        }
+
+        // continue from the saved conversation, otherwise evaluate the history again with the next prompt
+        std::vector<llama_token> restored(std::max<size_t>(seq_tokens.size(), 1));
+        size_t n_restored = 0;
+        if (state_file.empty() ||
+            llama_state_seq_load_file(ctx.get(), state_file.c_str(), seq_id, restored.data(), restored.size(), &n_restored) == 0 ||
+            n_restored != seq_tokens.size() || !std::equal(seq_tokens.begin(), seq_tokens.end(), restored.begin())) {
+            prefillSystem();
+            llama_sampler_reset(smpl.get());
+        } else if (scheduler) {
+            scheduler->setPrefix(seq_id, seq_tokens);
+        }
+        if (!state_file.empty()) {
+            std::error_code ec;
+            std::filesystem::remove(state_file, ec);
+            state_file = "";
+        }
+        MemoryManager::touch(this);
+        if (isVerbose) {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+            std::cout << "Reloaded " << model_name << " in " << elapsed.count() << " s" << std::endl;
+        }
+    }
+
+    // Memory the model frees when it is unloaded
+    uint64_t Model::residentMemory() const {
+        if (!ctx) {
+            return 0;
+        }
+        return memory_usage.kv_cache + (unload_weights ? memory_usage.weights : 0);
+    }
+
+    uint64_t Model::freeableMemory() const {
+        // a generating model is not unloaded, and its context may change meanwhile
+        std::unique_lock<std::recursive_mutex> lock(*ctx_mutex, std::try_to_lock);
+        if (!lock.owns_lock() || !ctx || (scheduler && scheduler->busy())) {
+            return 0;
+        }
+        uint64_t bytes = 0;
+        // the shared context is freed with the last model holding it
+        const bool frees_context = !shared_ctx || shared_ctx.use_count() == 1;
+        if (frees_context) {
+            bytes += kv_bytes_per_token * llama_n_ctx(ctx.get());
+        }
+        if (unload_weights && model) {
+            // other models, the intent matcher or a context of another group may hold the same weights
+            long holders = 1 + (shared_ctx && frees_context ? 1 : 0);
+            if (model.use_count() == holders) {
+                bytes += memory_usage.weights;
+            }
+        }
+        return bytes;
+    }
+
+    std::vector<std::pair<const void*, uint64_t>> Model::memoryResources() const {
+        std::vector<std::pair<const void*, uint64_t>> resources;
+        if (ctx) {
+            resources.push_back({ctx.get(), kv_bytes_per_token * llama_n_ctx(ctx.get())});
+        }
+        if (model) {
+            resources.push_back({model.get(), memory_usage.weights});
+        }
+        return resources;
+    }
+
+    // Identifies the model file and the context settings the KV state of a session depends on
+    std::string Model::sessionParams() const {
+        std::error_code ec;
+        auto model_size = std::filesystem::file_size(model_path, ec);
+        auto model_time = std::filesystem::last_write_time(model_path, ec).time_since_epoch().count();
+        nlohmann::json params = {
+            {"model", std::filesystem::absolute(model_path).string()},
+            {"model_size", model_size},
+            {"model_time", model_time},
+            {"n_ctx", n_ctx},
+            {"type_k", type_k},
+            {"type_v", type_v},
+            {"system", init_message}
+        };
+        return params.dump();
+    }
+
+    // Save the history and the KV state of the sequence
+    bool Model::saveSession(const std::string &path) {
+        std::filesystem::path file = path.empty() ? session_file : path;
+        if (file.empty() || !ctx_mutex) {
+            return false;
+        }
+        std::lock_guard<std::recursive_mutex> lock(*ctx_mutex);
+        // the session file holds the default conversation
+        if (!active_session.empty()) {
+            ensureLoaded();
+            switchSession("");
+        }
+        if (messages.empty()) {
+            return false;
+        }
+
+        // the state is only usable together with the tokens and chat positions it was evaluated at
+        std::vector<uint8_t> state;
+        if (ctx && !seq_tokens.empty()) {
+            state.resize(llama_state_seq_get_size(ctx.get(), seq_id));
+            if (llama_state_seq_get_data(ctx.get(), state.data(), state.size(), seq_id) != state.size()) {
+                state.clear();
+            }
+        }
+        nlohmann::json header = {
+            {"params", sessionParams()},
+            {"messages", nlohmann::json::array()},
+            {"tokens", state.empty() ? std::vector<llama_token>() : seq_tokens},
+            {"prev_len", prev_len},
+            {"checkpoint_len", checkpoint_len},
+            {"checkpoint_pos", checkpoint_pos}
+        };
+        for (const auto &msg : messages) {
+            header["messages"].push_back({{"role", msg.role}, {"content", msg.content}});
+        }
+
+        // magic, version, JSON header and the raw sequence state, a cut off write leaves the previous session intact
+        std::error_code ec;
+        if (file.has_parent_path()) {
+            std::filesystem::create_directories(file.parent_path(), ec);
+        }
+        std::filesystem::path tmp = file;
+        tmp += ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::binary);
+            std::string header_data = header.dump();
+            uint64_t header_size = header_data.size();
+            uint64_t state_size = state.size();
+            out.write("AZSESSN", 8);
+            out.write(reinterpret_cast<const char *>(&SESSION_VERSION), sizeof(SESSION_VERSION));
+            out.write(reinterpret_cast<const char *>(&header_size), sizeof(header_size));
+            out.write(header_data.data(), header_size);
+            out.write(reinterpret_cast<const char *>(&state_size), sizeof(state_size));
+            out.write(reinterpret_cast<const char *>(state.data()), state_size);
+            if (!out) {
+                std::cerr << "Failed to write the session " << tmp << std::endl;
+                return false;
+            }
+        }
+        std::filesystem::rename(tmp, file, ec);
+        if (ec) {
+            std::cerr << "Failed to write the session " << file << ": " << ec.message() << std::endl;
+            return false;
+        }
+        session_saved = std::chrono::steady_clock::now();
+        if (isVerbose) std::cout << "Saved session to " << file << " (" << messages.size() << " messages, " << state.size() / 1024 << " KiB state)" << std::endl;
+        return true;
+    }
+
+    // Restore the history and, if it still matches, the KV state of a saved session
+    bool Model::restoreSession(const std::string &path) {
+        std::filesystem::path file = path.empty() ? session_file : path;
+        if (file.empty() || !ctx_mutex) {
+            return false;
+        }
+        std::ifstream in(file, std::ios::binary);
+        if (!in) {
+            return false;
+        }
+        char magic[8] = {};
+        uint32_t version = 0;
+        uint64_t header_size = 0;
+        in.read(magic, sizeof(magic));
+        in.read(reinterpret_cast<char *>(&version), sizeof(version));
+        in.read(reinterpret_cast<char *>(&header_size), sizeof(header_size));
+        if (!in || std::string(magic, 7) != "AZSESSN" || version != SESSION_VERSION) {
+            std::cerr << "Ignoring session of another format: " << file << std::endl;
+            return false;
+        }
+        // sizes come from the file, a truncated or corrupt one must not allocate more than it holds
+        std::error_code ec;
+        uint64_t file_size = std::filesystem::file_size(file, ec);
+        uint64_t offset = sizeof(magic) + sizeof(version) + sizeof(header_size);
+        if (ec || header_size > file_size - offset || file_size - offset - header_size < sizeof(uint64_t)) {
+            std::cerr << "Ignoring truncated session: " << file << std::endl;
+            return false;
         }
+        std::string header_data(header_size, '\0');
+        uint64_t state_size = 0;
+        in.read(header_data.data(), header_size);
+        in.read(reinterpret_cast<char *>(&state_size), sizeof(state_size));
+        offset += header_size + sizeof(state_size);
+        if (!in || state_size > file_size - offset) {
+            std::cerr << "Ignoring truncated session: " << file << std::endl;
+            return false;
+        }
+        std::vector<uint8_t> state(state_size);
+        in.read(reinterpret_cast<char *>(state.data()), state.size());
+        nlohmann::json header = nlohmann::json::parse(header_data, nullptr, false);
+        if (!in || header.is_discarded() || !header.contains("messages") || header["messages"].empty()) {
+            std::cerr << "Ignoring unreadable session: " << file << std::endl;
+            return false;
+        }
+
+        std::lock_guard<std::recursive_mutex> lock(*ctx_mutex);
+        ensureLoaded();
+        switchSession("");
+        std::vector<chat_messages> restored;
+        for (const auto &msg : header["messages"]) {
+            restored.push_back({msg.value("role", ""), msg.value("content", "")});
+        }
+        // the current system message replaces the saved one, a summary folded into it is kept
+        if (restored.front().content.compare(0, init_message.size(), init_message) != 0) {
+            restored.front() = {"system", init_message};
+        }
+        messages = restored;
+
+        bool state_valid = !state.empty() && header.value("params", "") == sessionParams();
+        std::vector<llama_token> tokens = header.value("tokens", std::vector<llama_token>());
+        if (state_valid && (int)tokens.size() <= contextSize()) {
+            truncate(0);
+            state_valid = llama_state_seq_set_data(ctx.get(), state.data(), state.size(), seq_id) == state.size();
+        } else {
+            state_valid = false;
+        }
+        if (state_valid) {
+            seq_tokens = tokens;
+            prev_len = header.value("prev_len", 0);
+            checkpoint_len = header.value("checkpoint_len", 0);
+            checkpoint_pos = header.value("checkpoint_pos", 0);
+        } else {
+            // the history is evaluated again with the next prompt
+            prefillSystem();
+        }
+        llama_sampler_reset(smpl.get());
+        session_saved = std::chrono::steady_clock::now();
+        if (isVerbose) {
+            std::cout << "Restored session from " << file << " (" << messages.size() << " messages, "
+                      << (state_valid ? "KV state restored" : "KV state evaluated again") << ")" << std::endl;
+        }
+        return true;
     }
 
     // Generate a response based on the prompt
     std::string Model::generate(const std::string &prompt) {
-        std::string response;
+        return generate(prompt, nullptr);
+    }
 
-        const bool is_first = llama_memory_seq_pos_max(llama_get_memory(ctx.get()), 0) == 0;
+    // Make a conversation active, the sequence of the previous one stays in the context until it is needed
+    void Model::switchSession(const std::string &session) {
+        if (session == active_session) {
+            return;
+        }
+        Conversation &previous = conversations[active_session];
+        previous.messages = std::move(messages);
+        previous.seq_tokens = std::move(seq_tokens);
+        previous.prev_len = prev_len;
+        previous.checkpoint_len = checkpoint_len;
+        previous.checkpoint_pos = checkpoint_pos;
+        previous.seq_id = seq_id;
+        previous.state_file = "";
+        previous.last_used = std::chrono::steady_clock::now();
 
-        // tokenize the prompt
-        const int n_prompt_tokens = -llama_tokenize(vocab, prompt.c_str(), prompt.size(), NULL, 0, is_first, true);
-        std::vector<llama_token> prompt_tokens(n_prompt_tokens);
-        if (llama_tokenize(vocab, prompt.c_str(), prompt.size(), prompt_tokens.data(), prompt_tokens.size(), is_first, true) < 0) {
-            throw std::runtime_error("Failed to tokenize the prompt");
+        Conversation next;
+        auto it = conversations.find(session);
+        const bool known = it != conversations.end();
+        if (known) {
+            next = std::move(it->second);
+            conversations.erase(it);
+        }
+        active_session = session;
+        messages = std::move(next.messages);
+        seq_tokens = std::move(next.seq_tokens);
+        prev_len = next.prev_len;
+        checkpoint_len = next.checkpoint_len;
+        checkpoint_pos = next.checkpoint_pos;
+        llama_sampler_reset(smpl.get());
+        if (next.seq_id >= 0) {
+            seq_id = next.seq_id;
+            return;
+        }
+
+        seq_id = freeSequence();
+        llama_memory_t mem = llama_get_memory(ctx.get());
+        llama_memory_seq_rm(mem, seq_id, -1, -1);
+        if (known) {
+            // load the parked sequence, otherwise the history is evaluated again with the next prompt
+            bool restored = false;
+            if (!next.state_file.empty() && !seq_tokens.empty()) {
+                std::vector<llama_token> tokens(seq_tokens.size());
+                size_t n_restored = 0;
+                restored = llama_state_seq_load_file(ctx.get(), next.state_file.c_str(), seq_id, tokens.data(), tokens.size(), &n_restored) > 0 &&
+                           n_restored == seq_tokens.size() && std::equal(seq_tokens.begin(), seq_tokens.end(), tokens.begin());
+            }
+            if (!next.state_file.empty()) {
+                std::error_code ec;
+                std::filesystem::remove(next.state_file, ec);
+            }
+            if (!restored) {
+                prefillSystem();
+            }
+            if (isVerbose) std::cout << "Resumed conversation " << session << (restored ? "" : ", history evaluated again") << std::endl;
+            return;
         }
 
-        // prepare a batch for the prompt
-        llama_batch batch = llama_batch_get_one(prompt_tokens.data(), prompt_tokens.size());
-        llama_token new_token_id;
+        // the system message is the same in every conversation, a conversation holding it shares it with the new one
+        messages = {{"system", init_message}};
+        for (const auto &[name, conv] : conversations) {
+            // a summary folded into the system message is not shared
+            bool same_system = !conv.messages.empty() && conv.messages.front().content == init_message;
+            if (same_system && conv.seq_id >= 0 && conv.checkpoint_pos > 0 && (llama_pos)conv.seq_tokens.size() >= conv.checkpoint_pos) {
+                llama_memory_seq_cp(mem, conv.seq_id, seq_id, 0, conv.checkpoint_pos);
+                seq_tokens.assign(conv.seq_tokens.begin(), conv.seq_tokens.begin() + conv.checkpoint_pos);
+                checkpoint_pos = conv.checkpoint_pos;
+                checkpoint_len = conv.checkpoint_len;
+                prev_len = checkpoint_len;
+                break;
+            }
+        }
+        if (seq_tokens.empty()) {
+            prefillSystem();
+        }
+        if (isVerbose) std::cout << "Started conversation " << session << " in sequence " << seq_id << std::endl;
+    }
+
+    // Find a sequence no conversation is held in
+    llama_seq_id Model::freeSequence() {
+        for (llama_seq_id seq : seq_slots) {
+            bool used = false;
+            for (const auto &[name, conv] : conversations) {
+                used = used || conv.seq_id == seq;
+            }
+            if (!used) {
+                return seq;
+            }
+        }
+        Conversation *oldest = nullptr;
+        for (auto &[name, conv] : conversations) {
+            if (conv.seq_id >= 0 && (!oldest || conv.last_used < oldest->last_used)) {
+                oldest = &conv;
+            }
+        }
+        if (!oldest) {
+            throw std::runtime_error("No sequence left for the conversation");
+        }
+        llama_seq_id seq = oldest->seq_id;
+        parkConversation(*oldest);
+        return seq;
+    }
+
+    // Move the KV state of an inactive conversation to disk
+    void Model::parkConversation(Conversation &conv) {
+        conv.state_file = "";
+        if (!conv.seq_tokens.empty()) {
+            std::string file = (std::filesystem::temp_directory_path() / ("azazel-" + std::to_string(reinterpret_cast<uintptr_t>(this)) +
+                                "-" + std::to_string(reinterpret_cast<uintptr_t>(&conv)) + ".seq")).string();
+            if (llama_state_seq_save_file(ctx.get(), file.c_str(), conv.seq_id, conv.seq_tokens.data(), conv.seq_tokens.size()) > 0) {
+                conv.state_file = file;
+            }
+        }
+        llama_memory_seq_rm(llama_get_memory(ctx.get()), conv.seq_id, -1, -1);
+        if (isVerbose) std::cout << "Parked conversation of sequence " << conv.seq_id << " (" << conv.seq_tokens.size() << " tokens)" << std::endl;
+        conv.seq_id = -1;
+    }
+
+    // Forget a conversation
+    void Model::endSession(const std::string &session) {
+        std::lock_guard<std::recursive_mutex> lock(*ctx_mutex);
+        if (session.empty()) {
+            ensureLoaded();
+            switchSession(session);
+            clearHistory();
+            return;
+        }
+        if (session == active_session) {
+            ensureLoaded();
+            switchSession("");
+        }
+        auto it = conversations.find(session);
+        if (it == conversations.end()) {
+            return;
+        }
+        if (it->second.seq_id >= 0 && ctx) {
+            llama_memory_seq_rm(llama_get_memory(ctx.get()), it->second.seq_id, -1, -1);
+        }
+        if (!it->second.state_file.empty()) {
+            std::error_code ec;
+            std::filesystem::remove(it->second.state_file, ec);
+        }
+        conversations.erase(it);
+    }
+
+    std::vector<std::string> Model::getSessionNames() const {
+        if (!ctx_mutex) return {active_session};
+        std::lock_guard<std::recursive_mutex> lock(*ctx_mutex);
+        std::vector<std::string> names = {active_session};
+        for (const auto &[name, conv] : conversations) {
+            names.push_back(name);
+        }
+        return names;
+    }
+
+    // Generate a response based on the prompt, passing each piece to the callback as soon as it is sampled
+    std::string Model::generate(const std::string &prompt, const TokenCallback &onPiece, const GenerationOptions &options) {
+        using clock = std::chrono::steady_clock;
+        const clock::time_point request_start = clock::now();
+        auto elapsed_ms = [](clock::time_point since) {
+            return std::chrono::duration<double, std::milli>(clock::now() - since).count();
+        };
+
+        std::lock_guard<std::recursive_mutex> lock(*ctx_mutex);
+        ensureLoaded();
+        PerfStats perf;
+        const double sample_start = llama_perf_sampler(smpl.get()).t_sample_ms;
+        std::string response;
+        size_t n_sent = 0; // bytes of the response passed to the callback
+        int n_generated = 0; // tokens added to the response
+        size_t n_evaluated = 0; // tokens of the response in the context
+        bool stopped = false; // a stop sequence was found
+
+        // per request overrides of the model limits
+        const int max_gen = options.max_tokens.value_or(max_tokens);
+        const std::vector<std::string> &stops = options.stop.value_or(stop_sequences);
+
+        // pass on the response up to the given length, ending on a complete UTF-8 character
+        auto send = [&](size_t n_ready) {
+            if (!onPiece || n_ready <= n_sent) {
+                return true;
+            }
+            size_t complete = utf8CompleteLength(response.substr(n_sent, n_ready - n_sent));
+            if (complete == 0) {
+                return true;
+            }
+            bool keepGoing = onPiece(response.substr(n_sent, complete));
+            n_sent += complete;
+            return keepGoing;
+        };
+
+        // print the piece and add it to the response
+        auto append = [&](const std::string &piece) {
             if (isVerbose) {
-                std::cout << "Generated token: " << std::endl;
-            }
-            while (true) {
-                // check if there is enough space in the context to evaluate this batch
-                int n_ctx_batch = llama_n_ctx(ctx.get());
-                int n_ctx_used = llama_memory_seq_pos_max(llama_get_memory(ctx.get()), 0);
-                if (n_ctx_used + batch.n_tokens > n_ctx_batch) {
-                    throw std::runtime_error("Context size exceeded");
-                    return "";
-                }
+                printf("%s", piece.c_str());
+            }
+            fflush(stdout);
+            response += piece;
+            size_t n_hold = matchStop(response, piece.size(), stops, stopped);
+            bool keepGoing = send(response.size() - n_hold);
+            return keepGoing && !stopped && (max_gen <= 0 || n_generated < max_gen);
+        };
+
+        // convert the token to a string and add it to the response
+        auto emit = [&](llama_token token) {
+            char buf[256];
+            int n = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, true);
+            if (n < 0) {
+                throw std::runtime_error("Failed to convert token to piece");
+            }
+            if (n_generated++ == 0) {
+                perf.ttft_ms = elapsed_ms(request_start);
+            }
+            return append(std::string(buf, n));
+        };
+
+        // tokenize the prompt and evaluate it
+        std::vector<llama_token> prompt_tokens = tokenize(prompt);
+        clock::time_point decode_start = clock::now();
+        decode(prompt_tokens.data(), prompt_tokens.size());
+        llama_synchronize(ctx.get()); // decoding may still run on the backend
+        perf.prefill_ms = elapsed_ms(decode_start);
+        perf.prompt_tokens = prompt_tokens.size();
 
-                if (llama_decode(ctx.get(), batch)) {
-                    throw std::runtime_error("Failed to decode");
+        if (isVerbose) {
+            std::cout << "Generated token: " << std::endl;
+        }
+        // sample the first token
+        llama_token new_token_id = llama_sampler_sample(smpl.get(), ctx.get(), -1);
+        bool keepGoing = true;
+
+        // is it an end of generation?
+        while (keepGoing && !llama_vocab_is_eog(vocab, new_token_id)) {
+            keepGoing = emit(new_token_id);
+
+            // text the response has to continue with is not sampled
+            Completion completion;
+            if (keepGoing && completion_hook) {
+                completion = completion_hook(response);
+            }
+            if (completion.complete && !keepHistory) {
+                // nothing is generated after the response, so the rest is never evaluated
+                // it still counts against the token limit like the sampled tokens
+                for (llama_token token : tokenize(completion.text)) {
+                    if (!emit(token)) {
+                        break;
+                    }
                 }
+                break;
+            }
+            std::vector<llama_token> forced;
+            if (!completion.text.empty()) {
+                for (llama_token token : tokenize(completion.text)) {
+                    llama_sampler_accept(smpl.get(), token);
+                    forced.push_back(token);
+                    if (!(keepGoing = emit(token))) {
+                        break;
+                    }
+                }
+            }
 
-                // sample the next token
-                new_token_id = llama_sampler_sample(smpl.get(), ctx.get(), -1);
+            // evaluate the sampled token together with the forced or drafted continuation
+            std::vector<llama_token> draft;
+            if (keepGoing && !completion.complete && forced.empty()) {
+                draft = draftTokens(new_token_id);
+            }
+            std::vector<llama_token> batch = {new_token_id};
+            batch.insert(batch.end(), forced.begin(), forced.end());
+            batch.insert(batch.end(), draft.begin(), draft.end());
+            decode_start = clock::now();
+            decode(batch.data(), batch.size(), true);
+            llama_synchronize(ctx.get());
+            perf.decode_ms += elapsed_ms(decode_start);
+            size_t n_past = seq_tokens.size() - batch.size(); // the context may have been shifted
+            if (!keepGoing || completion.complete) {
+                n_evaluated += batch.size();
+                break;
+            }
 
-                // is it an end of generation?
-                if (llama_vocab_is_eog(vocab, new_token_id)) {
+            // keep the drafted tokens for as long as the model samples the same ones
+            size_t n_accepted = 0;
+            new_token_id = llama_sampler_sample(smpl.get(), ctx.get(), forced.size());
+            while (n_accepted < draft.size() && new_token_id == draft[n_accepted] && !llama_vocab_is_eog(vocab, new_token_id)) {
+                keepGoing = emit(new_token_id);
+                n_accepted++;
+                if (!keepGoing) {
                     break;
                 }
+                new_token_id = llama_sampler_sample(smpl.get(), ctx.get(), n_accepted);
+            }
 
-                // convert the token to a string, print it and add it to the response
+            // remove the rejected part of the draft from the context
+            truncate(n_past + 1 + forced.size() + n_accepted);
+            n_evaluated += 1 + forced.size() + n_accepted;
+            draft_stats.drafted += draft.size();
+            draft_stats.accepted += n_accepted;
+        }
+        if (isVerbose) {
+            std::cout << std::endl;
+            if (draft_ctx || lookup_ngram > 0) {
+                std::cout << "Draft acceptance: " << draft_stats.accepted << "/" << draft_stats.drafted
+                          << " (" << draft_stats.acceptanceRate() * 100.0f << "%)" << std::endl;
+            }
+        }
+        // the tokens of a stop sequence are not part of the conversation
+        if (stopped) {
+            size_t n_first = seq_tokens.size() - std::min(n_evaluated, seq_tokens.size());
+            size_t n_kept = n_first;
+            size_t kept = 0;
+            for (; n_kept < seq_tokens.size(); n_kept++) {
                 char buf[256];
-                int n = llama_token_to_piece(vocab, new_token_id, buf, sizeof(buf), 0, true);
-                if (n < 0) {
-                    throw std::runtime_error("Failed to convert token to piece");
+                int n = llama_token_to_piece(vocab, seq_tokens[n_kept], buf, sizeof(buf), 0, true);
+                if (n < 0 || kept + n > response.size()) {
+                    break;
                 }
-                std::string piece(buf, n);
-                if (isVerbose) {
-                    printf("%s", piece.c_str());
+                kept += n;
+            }
+            truncate(n_kept);
+            // the cut fell inside a token, the text up to it is evaluated again so the context matches the response
+            if (keepHistory && kept < response.size()) {
+                std::vector<llama_token> rest = tokenize(response.substr(kept));
+                decode(rest.data(), rest.size());
+            }
+        }
+        if (onPiece && n_sent < response.size()) {
+            onPiece(response.substr(n_sent));
+        }
+
+        perf.generated_tokens = n_generated;
+        perf.sample_ms = llama_perf_sampler(smpl.get()).t_sample_ms - sample_start;
+        perf.total_ms = elapsed_ms(request_start);
+        if (!internal_request) {
+            last_perf = perf;
+        }
+        if (isVerbose) {
+            std::cout << "Prefill: " << perf.prompt_tokens << " tokens, " << perf.prefillTokensPerSecond() << " tokens/s, "
+                      << "decode: " << perf.generated_tokens << " tokens, " << perf.decodeTokensPerSecond() << " tokens/s, "
+                      << "first token after " << perf.ttft_ms << " ms" << std::endl;
+        }
+        if (!perf_log.empty() && !internal_request) {
+            logPerf(perf);
+        }
+
+        return response;
+    }
+
+    // Propose tokens following the sampled token with the draft model
+    std::vector<llama_token> Model::draftTokens(const llama_token last) {
+        std::vector<llama_token> draft;
+        if (n_draft <= 0) {
+            return draft;
+        }
+        if (!draft_ctx) {
+            return lookupTokens(last);
+        }
+
+        // bring the draft context to the same tokens as the sequence, reusing the common prefix
+        std::vector<llama_token> target = seq_tokens;
+        target.push_back(last);
+        size_t n_common = 0;
+        while (n_common < draft_tokens.size() && n_common + 1 < target.size() && draft_tokens[n_common] == target[n_common]) {
+            n_common++;
+        }
+        llama_memory_seq_rm(llama_get_memory(draft_ctx.get()), 0, n_common, -1);
+        draft_tokens.resize(n_common);
+
+        int n_batch = llama_n_batch(draft_ctx.get());
+        for (size_t i = n_common; i < target.size(); i += n_batch) {
+            int n_tokens = std::min<size_t>(n_batch, target.size() - i);
+            decodeBatch(draft_ctx.get(), target.data() + i, n_tokens, i, 0, false);
+        }
+        draft_tokens = target;
+
+        // leave room for the verification batch
+        int n_max = std::min<int>(n_draft, contextSize() - (int)target.size() - 1);
+        while ((int)draft.size() < n_max) {
+            llama_token token = llama_sampler_sample(draft_smpl.get(), draft_ctx.get(), -1);
+            draft.push_back(token);
+            if (llama_vocab_is_eog(vocab, token) || (int)draft.size() == n_max) {
+                break;
+            }
+            decodeBatch(draft_ctx.get(), &token, 1, draft_tokens.size(), 0, false);
+            draft_tokens.push_back(token);
+        }
+        return draft;
+    }
+
+    // Cut the response at a stop sequence, or hold back a possible start of one
+    size_t Model::matchStop(std::string &response, const size_t piece_size, const std::vector<std::string> &stops, bool &stopped) {
+        size_t max_stop = 0;
+        for (const auto &stop : stops) {
+            max_stop = std::max(max_stop, stop.size());
+        }
+        if (max_stop == 0) {
+            return 0;
+        }
+        size_t from = response.size() > piece_size + max_stop - 1 ? response.size() - piece_size - max_stop + 1 : 0;
+        size_t found = std::string::npos;
+        for (const auto &stop : stops) {
+            if (stop.empty()) continue;
+            found = std::min(found, response.find(stop, from));
+        }
+        if (found != std::string::npos) {
+            response.resize(found);
+            stopped = true;
+            return 0;
+        }
+        // hold back text that may turn out to be the start of a stop sequence
+        size_t n_hold = 0;
+        for (const auto &stop : stops) {
+            if (stop.empty()) continue;
+            for (size_t len = std::min(stop.size() - 1, response.size()); len > n_hold; --len) {
+                if (response.compare(response.size() - len, len, stop, 0, len) == 0) {
+                    n_hold = len;
+                    break;
                 }
-                fflush(stdout);
-                response += piece;
+            }
+        }
+        return n_hold;
+    }
 
-                // prepare the next batch with the sampled token
-                batch = llama_batch_get_one(&new_token_id, 1);
+    // Length of the string up to the last complete UTF-8 character
+    size_t Model::utf8CompleteLength(const std::string &text) {
+        size_t i = text.size();
+        // find the start of the last character, at most 3 continuation bytes back
+        size_t back = 0;
+        while (i > 0 && back < 4 && (static_cast<unsigned char>(text[i - 1]) & 0xC0) == 0x80) {
+            i--;
+            back++;
+        }
+        if (i == 0) {
+            return 0;
+        }
+        unsigned char lead = static_cast<unsigned char>(text[i - 1]);
+        size_t expected = 1;
+        if ((lead & 0xE0) == 0xC0) expected = 2;
+        else if ((lead & 0xF0) == 0xE0) expected = 3;
+        else if ((lead & 0xF8) == 0xF0) expected = 4;
+
+        // the last character is complete, or the lead byte is not a multi byte start
+        if (back + 1 >= expected) {
+            return text.size();
+        }
+        return i - 1;
+    }
+
+    // Propose the tokens that followed the latest earlier occurrence of the last n-gram
+    std::vector<llama_token> Model::lookupTokens(const llama_token last) const {
+        if (lookup_ngram <= 0) {
+            return {};
+        }
+        // leave room for the verification batch
+        int n_max = std::min<int>(n_draft, contextSize() - (int)seq_tokens.size() - 2);
+        return lookupNgram(seq_tokens, last, lookup_ngram, n_max);
+    }
+
+    std::vector<llama_token> Model::lookupNgram(const std::vector<llama_token> &tokens, const llama_token last, const int ngram, const int n_max) {
+        std::vector<llama_token> draft;
+        if (n_max <= 0) {
+            return draft;
+        }
+
+        // the sequence followed by the sampled token
+        const size_t n_history = tokens.size() + 1;
+        auto tokenAt = [&](size_t i) { return i < tokens.size() ? tokens[i] : last; };
+
+        // longer n-grams are more likely to continue the same way, short ones are only tried if they fail
+        int n_min = std::min(2, ngram);
+        for (int n = ngram; n >= n_min; --n) {
+            if (n_history <= (size_t)n) {
+                continue;
             }
-            if (isVerbose) {
-                std::cout << std::endl;
+            const size_t ngram_start = n_history - n;
+            for (size_t i = ngram_start; i-- > 0;) {
+                bool match = true;
+                for (int j = 0; j < n; ++j) {
+                    if (tokenAt(i + j) != tokenAt(ngram_start + j)) {
+                        match = false;
+                        break;
+                    }
+                }
+                if (match) {
+                    for (size_t k = i + n; k < n_history && (int)draft.size() < n_max; ++k) {
+                        draft.push_back(tokenAt(k));
+                    }
+                    return draft;
+                }
+            }
+        }
+        return draft;
+    }
+
+    // Decode tokens at the end of the sequence of this model
+    void Model::decode(const llama_token *tokens, const int n_tokens, const bool all_logits) {
+        // check if there is enough space in the context to evaluate this batch
+        if ((int)seq_tokens.size() + n_tokens > contextSize()) {
+            if (context_policy == "none" || !shiftContext(n_tokens)) {
+                throw std::runtime_error("Context size exceeded");
             }
+        }
+        int n_ctx_used = seq_tokens.size();
 
-        return response;
+        // a shared context runs with the thread counts of the model that used it last
+        if (shared_ctx && (llama_n_threads(ctx.get()) != threads || llama_n_threads_batch(ctx.get()) != threads_batch)) {
+            llama_set_n_threads(ctx.get(), threads, threads_batch);
+        }
+
+        // one decode call takes at most n_batch tokens
+        int n_batch = llama_n_batch(ctx.get());
+        for (int i = 0; i < n_tokens; i += n_batch) {
+            decodeBatch(ctx.get(), tokens + i, std::min(n_batch, n_tokens - i), n_ctx_used + i, seq_id, all_logits);
+        }
+        seq_tokens.insert(seq_tokens.end(), tokens, tokens + n_tokens);
+    }
+
+    // Decode tokens of one sequence starting at the given position
+    void Model::decodeBatch(llama_context *context, const llama_token *tokens, const int n_tokens,
+                            const llama_pos pos, const llama_seq_id seq, const bool all_logits) {
+        llama_batch batch = llama_batch_init(n_tokens, 0, 1);
+        for (int i = 0; i < n_tokens; i++) {
+            batch.token[i] = tokens[i];
+            batch.pos[i] = pos + i;
+            batch.n_seq_id[i] = 1;
+            batch.seq_id[i][0] = seq;
+            batch.logits[i] = all_logits || i == n_tokens - 1;
+        }
+        batch.n_tokens = n_tokens;
+
+        int result = llama_decode(context, batch);
+        llama_batch_free(batch);
+        if (result) {
+            throw std::runtime_error("Failed to decode");
+        }
+    }
+
+    // Discard the oldest tokens after the system message and move the rest back
+    bool Model::shiftContext(const int n_tokens) {
+        llama_memory_t mem = llama_get_memory(ctx.get());
+        if (!llama_memory_can_shift(mem)) {
+            return false;
+        }
+        const int n_keep = checkpoint_pos;
+        const int n_discard = shiftDiscard(n_keep, seq_tokens.size(), n_tokens, contextSize());
+        if (n_discard == 0) {
+            return false;
+        }
+        if (isVerbose) std::cout << "Context full, discarding " << n_discard << " tokens" << std::endl;
+
+        llama_memory_seq_rm(mem, seq_id, n_keep, n_keep + n_discard);
+        llama_memory_seq_add(mem, seq_id, n_keep + n_discard, -1, -n_discard);
+        seq_tokens.erase(seq_tokens.begin() + n_keep, seq_tokens.begin() + n_keep + n_discard);
+        return true;
+    }
+
+    int Model::shiftDiscard(const int n_keep, const int n_used, const int n_tokens, const int n_ctx) {
+        // half of the conversation goes, so shifting does not happen on every token
+        const int n_discard = std::max((n_used - n_keep) / 2, n_used + n_tokens - n_ctx);
+        if (n_discard <= 0 || n_keep + n_discard > n_used) {
+            return 0;
+        }
+        return n_discard;
+    }
+
+    // Drop the oldest turns until the conversation and room for the response fit into the context
+    void Model::compactHistory() {
+        const int reserve = contextSize() / 4;
+        bool dropped = false;
+
+        // the system message and the new user message always stay
+        while (messages.size() > 2) {
+            std::string formatted = applyTemplate(messages, true);
+            int n_used = dropped ? checkpoint_pos : seq_tokens.size();
+            int from = dropped ? checkpoint_len : prev_len;
+            int n_prompt = from < (int)formatted.size() ? tokenize(formatted.substr(from)).size() : 0;
+            if (n_used + n_prompt + reserve <= contextSize()) {
+                break;
+            }
+
+            // remove the oldest user message and the reply to it
+            messages.erase(messages.begin() + 1);
+            if (messages.size() > 2 && messages[1].role == "assistant") {
+                messages.erase(messages.begin() + 1);
+            }
+            dropped = true;
+        }
+
+        // the remaining history is evaluated again after the system message
+        if (dropped) {
+            if (isVerbose) std::cout << "Compacted chat history to " << messages.size() << " messages" << std::endl;
+            truncate(checkpoint_pos);
+            prev_len = checkpoint_len;
+        }
+    }
+
+    // Replace the old turns of the history with a summary generated by the model
+    bool Model::summarizeHistory() {
+        std::lock_guard<std::recursive_mutex> lock(*ctx_mutex);
+        if (!ctx || !keepHistory || summary_budget <= 0 || (int)seq_tokens.size() - checkpoint_pos <= summary_budget) {
+            return false;
+        }
+
+        // the last turn stays as it is
+        size_t n_recent = messages.back().role == "assistant" ? 2 : 1;
+        if (messages.size() < n_recent + 2) {
+            return false;
+        }
+        std::vector<chat_messages> recent(messages.end() - n_recent, messages.end());
+        if (isVerbose) std::cout << "Summarizing " << messages.size() - n_recent - 1 << " messages" << std::endl;
+
+        // ask for the summary after the evaluated history, which stays in the context until the summary is there
+        std::vector<chat_messages> request = messages;
+        request.push_back({"user", "Summarize the conversation so far in a few sentences. Keep names, facts and decisions."});
+        std::string formatted_request = applyTemplate(request, true);
+        if (prev_len > (int)formatted_request.size()) {
+            return false;
+        }
+        std::string summary_prompt = formatted_request.substr(prev_len);
+        const int summary_tokens = 256;
+        const size_t n_history = seq_tokens.size();
+        if ((int)(n_history + tokenize(summary_prompt).size()) + summary_tokens >= contextSize()) {
+            return false; // no room left, the oldest turns are dropped instead
+        }
+        std::string summary;
+        internal_request = true;
+        try {
+            GenerationOptions summaryOptions;
+            summaryOptions.max_tokens = summary_tokens;
+            summary = generate(summary_prompt, nullptr, summaryOptions);
+        } catch (const std::exception &e) {
+            // aborted or failed, the history is still evaluated
+            internal_request = false;
+            truncate(n_history);
+            llama_sampler_reset(smpl.get());
+            throw;
+        }
+        internal_request = false;
+        truncate(n_history);
+        llama_sampler_reset(smpl.get());
+        if (summary.empty()) {
+            return false;
+        }
+
+        // chat templates expect a single system message at the start, the summary is folded into it
+        messages = {{"system", init_message + "\n\nSummary of the earlier conversation: " + summary}};
+        messages.insert(messages.end(), recent.begin(), recent.end());
+
+        // the system message changed, so the compacted history is evaluated from the start
+        // the new history is in place, it is evaluated without the abort callback of the background worker
+        llama_set_abort_callback(ctx.get(), nullptr, nullptr);
+        truncate(0);
+        checkpoint_pos = 0;
+        checkpoint_len = 0;
+        prev_len = 0;
+        std::string system = applyTemplate({messages.front()}, false);
+        std::string formatted = applyTemplate(messages, false);
+        try {
+            if (formatted.compare(0, system.size(), system) == 0) {
+                prefill(system);
+                checkpoint_pos = seq_tokens.size();
+                checkpoint_len = system.size();
+                prev_len = checkpoint_len;
+            }
+            prefill(formatted.substr(checkpoint_len));
+        } catch (const std::exception &e) {
+            // the next request evaluates the history after the system message again
+            truncate(checkpoint_pos);
+            prev_len = checkpoint_len;
+            throw;
+        }
+        prev_len = formatted.size();
+        return true;
+    }
+
+    // Waits for idle periods and summarizes the history at low priority
+    void Model::compactionWorker() {
+        std::unique_lock<std::mutex> lock(compaction->mtx);
+        while (!compaction->stop) {
+            compaction->cv.wait_for(lock, std::chrono::seconds(summary_idle));
+            if (compaction->stop) {
+                break;
+            }
+            if (std::chrono::steady_clock::now() - compaction->last_used < std::chrono::seconds(summary_idle)) {
+                continue;
+            }
+            lock.unlock();
+
+            std::unique_lock<std::recursive_mutex> ctxLock(*ctx_mutex, std::try_to_lock);
+            if (ctxLock.owns_lock() && ctx) {
+                // fewer threads, and stop as soon as a request comes in
+                int n_threads = llama_n_threads(ctx.get());
+                int n_threads_batch = llama_n_threads_batch(ctx.get());
+                llama_set_n_threads(ctx.get(), std::max(1, n_threads / 2), std::max(1, n_threads_batch / 2));
+                llama_set_abort_callback(ctx.get(), [](void *data) {
+                    return static_cast<std::atomic<bool>*>(data)->load();
+                }, &compaction->abort);
+                try {
+                    summarizeHistory();
+                } catch (const std::exception &e) {
+                    if (isVerbose) std::cout << "Summary interrupted: " << e.what() << std::endl;
+                }
+                llama_set_abort_callback(ctx.get(), nullptr, nullptr);
+                llama_set_n_threads(ctx.get(), n_threads, n_threads_batch);
+                ctxLock.unlock();
+            }
+
+            lock.lock();
+            compaction->last_used = std::chrono::steady_clock::now();
+        }
+    }
+
+    // Remove every token from the given position on from the sequence
+    void Model::truncate(const llama_pos n_keep) {
+        llama_memory_seq_rm(llama_get_memory(ctx.get()), seq_id, n_keep, -1);
+        if (n_keep < (llama_pos)seq_tokens.size()) {
+            seq_tokens.resize(n_keep);
+        }
+    }
+
+    // Context size available to the sequence of this model
+    int Model::contextSize() const {
+        return std::min<int>(n_ctx, llama_n_ctx(ctx.get()));
     }
 
     std::string Model::respond(const std::string &prompt) {
+        return respond(prompt, nullptr);
+    }
+
+    std::string Model::respond(const std::string &prompt, const TokenCallback &onPiece, const GenerationOptions &options) {
+        return respondInSession("", prompt, onPiece, options);
+    }
+
+    std::string Model::respondBatched(const std::string &prompt, const TokenCallback &onPiece, const GenerationOptions &options) {
+        BatchScheduler::Request request;
+        request.system = init_message;
+        request.prompt = prompt;
+        request.max_tokens = options.max_tokens.value_or(max_tokens);
+        request.stop = options.stop.value_or(stop_sequences);
+        request.onPiece = onPiece;
+        request.completion_hook = completion_hook;
+
+        // the context is loaded again if it was unloaded, it is not unloaded while the scheduler is busy
+        std::future<BatchScheduler::Result> pending;
+        {
+            std::lock_guard<std::recursive_mutex> lock(*ctx_mutex);
+            ensureLoaded();
+            pending = scheduler->submit(std::move(request));
+        }
+        BatchScheduler::Result result = pending.get();
+
+        std::lock_guard<std::recursive_mutex> lock(*ctx_mutex);
+        last_perf = result.perf;
+        MemoryManager::touch(this);
+        if (isVerbose) {
+            std::cout << "Prefill: " << result.perf.prompt_tokens << " tokens, " << result.perf.prefillTokensPerSecond() << " tokens/s, "
+                      << "decode: " << result.perf.generated_tokens << " tokens, " << result.perf.decodeTokensPerSecond() << " tokens/s, "
+                      << "first token after " << result.perf.ttft_ms << " ms (batched)" << std::endl;
+        }
+        if (!perf_log.empty()) {
+            logPerf(result.perf);
+        }
+        return result.response;
+    }
+
+    std::string Model::respondInSession(const std::string &session, const std::string &prompt, const TokenCallback &onPiece,
+                                        const GenerationOptions &options) {
         if (prompt.empty()) {
             return "";
         }
+        if (parallel > 1) {
+            return respondBatched(prompt, onPiece, options);
+        }
+        // a running background summary gives way to the request
+        if (compaction) {
+            compaction->abort = true;
+        }
+        std::lock_guard<std::recursive_mutex> lock(*ctx_mutex);
+        ensureLoaded();
+        switchSession(session);
+        if (compaction) {
+            compaction->abort = false;
+            std::lock_guard<std::mutex> idleLock(compaction->mtx);
+            compaction->last_used = std::chrono::steady_clock::now();
+        }
         // add the user input to the message list
         messages.push_back({"user", prompt});
 
-        // format the messages for the chat template
-        std::vector<llama_chat_message> llama_messages;
-        for (const auto &msg : messages) {
-            llama_messages.push_back({msg.role.c_str(), msg.content.c_str()});
+        // make room for the new turn by dropping old ones
+        if (keepHistory && context_policy == "compact") {
+            compactHistory();
         }
+
+        // apply the chat template to format the messages
+        std::string formatted = applyTemplate(messages, true);
+        int new_len = formatted.size();
+
         if (!keepHistory) {
             if (messages.size() > 1) {
                 messages.pop_back(); // remove the last user message if history is not kept
             }
+            // roll the context back to the system prompt, every request starts from the same state
+            truncate(checkpoint_pos);
+            llama_sampler_reset(smpl.get());
+            prev_len = checkpoint_len;
         }
 
-        std::vector<char> formatted(llama_n_ctx(ctx.get()));
-        int prev_len = 0;
-        std::string response = "";
-
-        const char* tmpl = llama_model_chat_template(model.get(), /* name */ nullptr);
-
-        // apply the chat template to format the messages
-        int new_len = llama_chat_apply_template(tmpl, llama_messages.data(), llama_messages.size(), true, formatted.data(), formatted.size());
-        if (new_len > (int)formatted.size()) {
-            formatted.resize(new_len);
-            new_len = llama_chat_apply_template(tmpl, llama_messages.data(), llama_messages.size(), true, formatted.data(), formatted.size());
-        }
-        if (new_len < 0) {
-            throw std::runtime_error("Failed to apply the chat template");
-            return "";
+        // the evaluated chat is no longer a prefix of the formatted one, continue from the system message
+        if (prev_len > new_len) {
+            truncate(checkpoint_pos);
+            llama_sampler_reset(smpl.get());
+            prev_len = checkpoint_len;
         }
 
         // remove previous messages to obtain the prompt to generate the response
-        std::string formatted_prompt(formatted.begin() + prev_len, formatted.begin() + new_len);
+        std::string formatted_prompt(formatted.begin() + prev_len, formatted.end());
 
         // generate a response
-        response = generate(formatted_prompt);
+        std::string response = generate(formatted_prompt, onPiece, options);
 
         // add the response to the messages
         if (keepHistory) {
             messages.push_back({"assistant", response}); 
-            std::vector<llama_chat_message> llama_messages_prev;
-            for (const auto &msg : messages) {
-                llama_messages_prev.push_back({msg.role.c_str(), msg.content.c_str()});
+            std::string full = applyTemplate(messages, false);
+
+            // the end of turn tokens after the response were never decoded, they are sent with the next prompt
+            if (new_len + response.size() <= full.size() &&
+                std::string_view(full).substr(new_len, response.size()) == response) {
+                prev_len = new_len + response.size();
+            } else {
+                prev_len = full.size();
             }
 
-            prev_len = llama_chat_apply_template(tmpl, llama_messages_prev.data(), llama_messages_prev.size(), false, nullptr, 0);
-            if (prev_len < 0) {
-                throw std::runtime_error("Failed to apply the chat template");
-                return "";
+            // a crash loses at most the turns since the last save
+            if (session.empty() && !session_file.empty() && session_interval > 0 &&
+                std::chrono::steady_clock::now() - session_saved >= std::chrono::seconds(session_interval)) {
+                saveSession();
             }
         }
         
         return response;
     }
 
+    // Look up the KV cache data type by name
+    ggml_type Model::cacheType(const std::string &name) {
+        static const std::vector<std::pair<std::string, ggml_type>> types = {
+            {"f32", GGML_TYPE_F32}, {"f16", GGML_TYPE_F16}, {"bf16", GGML_TYPE_BF16},
+            {"q8_0", GGML_TYPE_Q8_0}, {"q5_1", GGML_TYPE_Q5_1}, {"q5_0", GGML_TYPE_Q5_0},
+            {"q4_1", GGML_TYPE_Q4_1}, {"q4_0", GGML_TYPE_Q4_0}, {"iq4_nl", GGML_TYPE_IQ4_NL}
+        };
+        for (const auto &type : types) {
+            if (type.first == name) {
+                return type.second;
+            }
+        }
+        throw std::invalid_argument("Unknown KV cache type: " + name);
+    }
+
+    // Resolve the batch sizes before the context is created
+    void Model::tuneBatch(llama_context_params &params) {
+        if (n_threads > 0) {
+            params.n_threads = n_threads;
+        }
+        if (n_threads_batch > 0) {
+            params.n_threads_batch = n_threads_batch;
+        }
+
+        int ubatch = n_ubatch;
+        if (n_ubatch == AUTO && !context_group.empty()) {
+            ubatch = 0; // the shared context is created with the batch sizes declared for the group
+        } else if (n_ubatch == AUTO) {
+            ubatch = cachedTuning("n_ubatch");
+        }
+        if (ubatch == AUTO) {
+            // prefill the same prompt in scratch contexts, larger micro batches need a larger compute buffer
+            const int n_prompt = std::min(n_ctx, 1024);
+            const int max_ubatch = n_batch > 0 ? std::min(n_batch, n_prompt) : n_prompt;
+            std::vector<std::pair<int, double>> timings;
+            for (int candidate = 64; candidate <= max_ubatch; candidate *= 2) {
+                llama_context_params scratch_params = params;
+                scratch_params.n_ctx = n_prompt;
+                scratch_params.n_batch = n_prompt;
+                scratch_params.n_ubatch = candidate;
+                std::unique_ptr<llama_context, LlamaContextDeleter> scratch(llama_init_from_model(model.get(), scratch_params));
+                if (!scratch) {
+                    break;
+                }
+                timings.push_back({candidate, benchmarkDecode(scratch.get(), 0, n_prompt, 2)});
+                if (isVerbose) std::cout << "n_ubatch " << candidate << ": " << timings.back().second << " s" << std::endl;
+            }
+            if (timings.empty()) {
+                throw std::runtime_error("Failed to create a context to benchmark n_ubatch");
+            }
+
+            // the smallest micro batch that is about as fast as the fastest one
+            double fastest = timings.front().second;
+            for (const auto &timing : timings) {
+                fastest = std::min(fastest, timing.second);
+            }
+            for (const auto &timing : timings) {
+                if (timing.second <= fastest * 1.05) {
+                    ubatch = timing.first;
+                    break;
+                }
+            }
+            storeTuning("n_ubatch", ubatch);
+        }
+
+        // a larger decode call is split into micro batches anyway
+        int batch = n_batch == AUTO ? (ubatch > 0 ? ubatch : params.n_ubatch) : n_batch;
+        params.n_batch = batch > 0 ? std::min(batch, n_ctx) : n_ctx;
+        if (ubatch > 0) {
+            params.n_ubatch = std::min<uint32_t>(ubatch, params.n_batch);
+        }
+    }
+
+    // Resolve the thread counts once the context exists
+    void Model::tuneThreads(const llama_context_params &params) {
+        threads = n_threads > 0 ? n_threads : params.n_threads;
+        threads_batch = n_threads_batch > 0 ? n_threads_batch : params.n_threads_batch;
+
+        auto fastest = [&](const bool batch) {
+            int cached = cachedTuning(batch ? "n_threads_batch" : "n_threads");
+            if (cached != AUTO) {
+                return cached;
+            }
+            // powers of two up to the number of hardware threads, which is always tried
+            int n_hw = std::max(1u, std::thread::hardware_concurrency());
+            std::vector<int> candidates;
+            for (int candidate = 1; candidate < n_hw; candidate *= 2) {
+                candidates.push_back(candidate);
+            }
+            candidates.push_back(n_hw);
+
+            int best = candidates.back();
+            double best_time = 0.0;
+            for (int candidate : candidates) {
+                llama_set_n_threads(ctx.get(), batch ? threads : candidate, batch ? candidate : threads_batch);
+                double time = batch ? benchmarkDecode(ctx.get(), seq_id, std::min<int>(llama_n_ubatch(ctx.get()), 256), 2)
+                                    : benchmarkDecode(ctx.get(), seq_id, 1, 8);
+                if (isVerbose) std::cout << (batch ? "batch threads " : "threads ") << candidate << ": " << time << " s" << std::endl;
+                if (best_time == 0.0 || time < best_time) {
+                    best = candidate;
+                    best_time = time;
+                }
+            }
+            storeTuning(batch ? "n_threads_batch" : "n_threads", best);
+            return best;
+        };
+        if (n_threads == AUTO) {
+            threads = fastest(false);
+        }
+        if (n_threads_batch == AUTO) {
+            threads_batch = fastest(true);
+        }
+        llama_set_n_threads(ctx.get(), threads, threads_batch);
+    }
+
+    // Time decoding a batch into an empty sequence
+    double Model::benchmarkDecode(llama_context *context, const llama_seq_id seq, const int n_tokens, const int n_runs) {
+        const llama_vocab *context_vocab = llama_model_get_vocab(llama_get_model(context));
+        llama_token token = llama_vocab_bos(context_vocab);
+        std::vector<llama_token> tokens(n_tokens, token == LLAMA_TOKEN_NULL ? 0 : token);
+        llama_memory_t mem = llama_get_memory(context);
+
+        // the first run warms up the caches and is not counted
+        double best = 0.0;
+        for (int run = 0; run <= n_runs; run++) {
+            llama_memory_seq_rm(mem, seq, -1, -1);
+            auto start = std::chrono::steady_clock::now();
+            decodeBatch(context, tokens.data(), n_tokens, 0, seq, false);
+            llama_synchronize(context);
+            double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (run > 0 && (best == 0.0 || time < best)) {
+                best = time;
+            }
+        }
+        llama_memory_seq_rm(mem, seq, -1, -1);
+        return best;
+    }
+
+    // Key of the tuning results, they only hold for the same model, settings and host
+    std::string Model::tuningKey() const {
+        std::error_code ec;
+        auto model_size = std::filesystem::file_size(model_path, ec);
+        return std::filesystem::absolute(model_path).string() + ":" + std::to_string(model_size) + ":" +
+               std::to_string(n_ctx) + ":" + std::to_string(n_batch) + ":" + std::to_string(n_ubatch) + ":" + std::to_string(ngl) + ":" +
+               type_k + ":" + type_v + ":" + flash_attn + ":" + std::to_string(std::thread::hardware_concurrency());
+    }
+
+    // Look up a benchmarked setting in the tuning cache
+    int Model::cachedTuning(const std::string &setting) const {
+        if (cache_dir.empty()) {
+            return AUTO;
+        }
+        std::ifstream file(std::filesystem::path(cache_dir) / "tuning.json");
+        nlohmann::json tuning = nlohmann::json::parse(file, nullptr, false);
+        if (tuning.is_discarded() || !tuning.contains(tuningKey()) || !tuning[tuningKey()].contains(setting)) {
+            return AUTO;
+        }
+        return tuning[tuningKey()].value(setting, AUTO);
+    }
+
+    // Store a benchmarked setting in the tuning cache
+    void Model::storeTuning(const std::string &setting, const int value) const {
+        if (cache_dir.empty()) {
+            return;
+        }
+        std::filesystem::path path = std::filesystem::path(cache_dir) / "tuning.json";
+        nlohmann::json tuning;
+        {
+            std::ifstream file(path);
+            tuning = nlohmann::json::parse(file, nullptr, false);
+        }
+        if (!tuning.is_object()) {
+            tuning = nlohmann::json::object();
+        }
+        tuning[tuningKey()][setting] = value;
+
+        std::error_code ec;
+        std::filesystem::create_directories(cache_dir, ec);
+        std::ofstream file(path);
+        if (!file || !(file << tuning.dump(4))) {
+            if (isVerbose) std::cout << "Failed to write the tuning cache: " << path << std::endl;
+        }
+    }
+
+    // Decode the system message once and remember where it ends in the context
+    void Model::prefillSystem() {
+        truncate(0);
+        checkpoint_pos = 0;
+        checkpoint_len = 0;
+        prev_len = 0;
+        if (messages.empty()) {
+            return;
+        }
+
+        std::string system = applyTemplate({messages.front()}, false);
+        std::string formatted = applyTemplate(messages, true);
+
+        // the checkpoint is only usable if the system message is a prefix of every formatted chat
+        if (formatted.compare(0, system.size(), system) != 0) {
+            if (isVerbose) std::cout << "Chat template does not start with the system message, no checkpoint used" << std::endl;
+            return;
+        }
+
+        // restore the evaluated system message from a previous run if it is cached
+        std::string cache_file = "";
+        if (!cache_dir.empty()) {
+            cache_file = cacheFilePath(system);
+        }
+        if (!cache_file.empty() && std::filesystem::exists(cache_file)) {
+            std::vector<llama_token> expected = tokenize(system);
+            std::vector<llama_token> cached(expected.size());
+            size_t n_cached = 0;
+            if (llama_state_seq_load_file(ctx.get(), cache_file.c_str(), seq_id, cached.data(), cached.size(), &n_cached) > 0 &&
+                n_cached == expected.size() && std::equal(expected.begin(), expected.end(), cached.begin())) {
+                if (isVerbose) std::cout << "Loaded system prompt from cache: " << cache_file << std::endl;
+                seq_tokens = expected;
+            } else {
+                if (isVerbose) std::cout << "Discarding invalid system prompt cache: " << cache_file << std::endl;
+                truncate(0);
+                cache_file = "";
+            }
+        }
+        if (seq_tokens.empty()) {
+            std::vector<llama_token> tokens = prefill(system);
+            if (!cache_dir.empty()) {
+                cache_file = cacheFilePath(system);
+                std::filesystem::create_directories(cache_dir);
+                if (llama_state_seq_save_file(ctx.get(), cache_file.c_str(), seq_id, tokens.data(), tokens.size()) == 0) {
+                    std::cerr << "Failed to save system prompt cache: " << cache_file << std::endl;
+                } else if (isVerbose) {
+                    std::cout << "Saved system prompt to cache: " << cache_file << std::endl;
+                }
+            }
+        }
+        checkpoint_pos = seq_tokens.size();
+        checkpoint_len = system.size();
+        prev_len = checkpoint_len;
+        if (scheduler) {
+            scheduler->setPrefix(seq_id, seq_tokens);
+        }
+    }
+
+    // Cache file name for the evaluated system message
+    std::string Model::cacheFilePath(const std::string &system) const {
+        // FNV-1a is stable across builds, unlike std::hash
+        uint64_t hash = 14695981039346656037ull;
+        auto add = [&hash](const std::string &data) {
+            for (unsigned char c : data) {
+                hash ^= c;
+                hash *= 1099511628211ull;
+            }
+            hash ^= 0xff; // separator between fields
+            hash *= 1099511628211ull;
+        };
+
+        // a changed model file invalidates the cache as well
+        std::error_code ec;
+        auto model_size = std::filesystem::file_size(model_path, ec);
+        auto model_time = std::filesystem::last_write_time(model_path, ec).time_since_epoch().count();
+
+        add(std::filesystem::absolute(model_path).string());
+        add(std::to_string(model_size) + ":" + std::to_string(model_time));
+        add(system);
+        add(std::to_string(llama_n_ctx(ctx.get())) + ":" + std::to_string(llama_n_batch(ctx.get())) + ":" + std::to_string(ngl));
+        add(type_k + ":" + type_v);
+
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.kv", (unsigned long long)hash);
+        return (std::filesystem::path(cache_dir) / name).string();
+    }
+
+    // Decode a prompt into the context without sampling
+    std::vector<llama_token> Model::prefill(const std::string &prompt) {
+        std::vector<llama_token> prompt_tokens = tokenize(prompt);
+        decode(prompt_tokens.data(), prompt_tokens.size());
+        return prompt_tokens;
+    }
+
+    // Tokenize a prompt, the BOS token is only added at the start of the context
+    std::vector<llama_token> Model::tokenize(const std::string &prompt) const {
+        const bool is_first = seq_tokens.empty();
+
+        const int n_prompt_tokens = -llama_tokenize(vocab, prompt.c_str(), prompt.size(), NULL, 0, is_first, true);
+        std::vector<llama_token> prompt_tokens(n_prompt_tokens);
+        if (llama_tokenize(vocab, prompt.c_str(), prompt.size(), prompt_tokens.data(), prompt_tokens.size(), is_first, true) < 0) {
+            throw std::runtime_error("Failed to tokenize the prompt");
+        }
+        return prompt_tokens;
+    }
+
+    // Format messages with the chat template of the model
+    std::string Model::applyTemplate(const std::vector<chat_messages> &msgs, const bool add_ass) const {
+        std::vector<llama_chat_message> llama_messages;
+        for (const auto &msg : msgs) {
+            llama_messages.push_back({msg.role.c_str(), msg.content.c_str()});
+        }
+
+        const char* tmpl = llama_model_chat_template(model.get(), /* name */ nullptr);
+
+        std::vector<char> formatted(llama_n_ctx(ctx.get()));
+        int new_len = llama_chat_apply_template(tmpl, llama_messages.data(), llama_messages.size(), add_ass, formatted.data(), formatted.size());
+        if (new_len > (int)formatted.size()) {
+            formatted.resize(new_len);
+            new_len = llama_chat_apply_template(tmpl, llama_messages.data(), llama_messages.size(), add_ass, formatted.data(), formatted.size());
+        }
+        if (new_len < 0) {
+            throw std::runtime_error("Failed to apply the chat template");
+        }
+        return std::string(formatted.begin(), formatted.begin() + new_len);
+    }
+
+    // Append the timings of a generation to the perf log
+    void Model::logPerf(const PerfStats &perf) const {
+        nlohmann::json line = {
+            {"time", std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count()},
+            {"model", model_name},
+            {"path", std::filesystem::path(model_path).filename().string()},
+            {"type_k", type_k},
+            {"type_v", type_v},
+            {"prompt_tokens", perf.prompt_tokens},
+            {"generated_tokens", perf.generated_tokens},
+            {"prefill_ms", perf.prefill_ms},
+            {"decode_ms", perf.decode_ms},
+            {"sample_ms", perf.sample_ms},
+            {"ttft_ms", perf.ttft_ms},
+            {"total_ms", perf.total_ms},
+            {"prefill_tps", perf.prefillTokensPerSecond()},
+            {"decode_tps", perf.decodeTokensPerSecond()}
+        };
+        // models of different context groups may log to the same file at once
+        static std::mutex log_mutex;
+        std::lock_guard<std::mutex> lock(log_mutex);
+        std::ofstream file(perf_log, std::ios::app);
+        if (!file) {
+            std::cerr << "Failed to open the perf log " << perf_log << std::endl;
+            return;
+        }
+        file << line.dump() << std::endl;
+    }
+
     // Clear the model messages
     void Model::clearHistory() {
         while (messages.size() > 1) {
             messages.pop_back(); // keep the system message
         }
+        // the evaluated conversation no longer matches the messages
+        if (ctx_mutex) {
+            std::lock_guard<std::recursive_mutex> lock(*ctx_mutex);
+            if (ctx) {
+                truncate(checkpoint_pos);
+            } else if ((llama_pos)seq_tokens.size() > checkpoint_pos) {
+                // the saved state no longer matches either, the system message is evaluated again on reload
+                seq_tokens.resize(checkpoint_pos);
+            }
+        }
+        prev_len = checkpoint_len;
+    }
+
+    // Release the sequence of a shared context
+    Model::~Model() {
+        MemoryManager::untrack(this);
+        // the scheduler decodes in the context, it stops before the context is freed
+        scheduler.reset();
+        if (compaction) {
+            {
+                std::lock_guard<std::mutex> lock(compaction->mtx);
+                compaction->stop = true;
+                compaction->abort = true;
+            }
+            compaction->cv.notify_all();
+            if (compaction->worker.joinable()) compaction->worker.join();
+        }
+        // the conversation continues with the next start
+        if (keepHistory && !session_file.empty()) {
+            saveSession();
+        }
+        if (!state_file.empty()) {
+            std::error_code ec;
+            std::filesystem::remove(state_file, ec);
+        }
+        for (const auto &[name, conv] : conversations) {
+            if (!conv.state_file.empty()) {
+                std::error_code ec;
+                std::filesystem::remove(conv.state_file, ec);
+            }
+        }
+        if (shared_ctx && ctx) {
+            std::lock_guard<std::recursive_mutex> lock(*ctx_mutex);
+            for (llama_seq_id seq : seq_slots) {
+                llama_memory_seq_rm(llama_get_memory(ctx.get()), seq, -1, -1);
+                ModelRegistry::releaseContext(shared_ctx, seq);
+            }
+        }
     }
 
     // Constructor with parameters
@@ -206,7 +1773,40 @@
     void Model::setTopK(const int input) { top_k = input; }
     void Model::setKeepHistory(const bool input) { keepHistory = input; }
     void Model::setVerbose(const bool input) { isVerbose = input; }
-    void Model::setMessages(const std::vector<chat_messages>& messages) { this->messages = messages; }
+    void Model::setCacheDir(const std::string& input) { cache_dir = input; }
+    void Model::setContextGroup(const std::string& input) { context_group = input; }
+    void Model::setGrammar(const std::string& input) { grammar = input; }
+    void Model::setDraftPath(const std::string& input) { draft_path = input; }
+    void Model::setNDraft(const int input) { n_draft = input; }
+    void Model::setLookupNgram(const int input) { lookup_ngram = input; }
+    void Model::setContextPolicy(const std::string& input) { context_policy = input; }
+    void Model::setSummaryBudget(const int input) { summary_budget = input; }
+    void Model::setSummaryIdle(const int input) { summary_idle = input; }
+    void Model::setNBatch(const int input) { n_batch = input; }
+    void Model::setNUbatch(const int input) { n_ubatch = input; }
+    void Model::setNThreads(const int input) { n_threads = input; }
+    void Model::setNThreadsBatch(const int input) { n_threads_batch = input; }
+    void Model::setTypeK(const std::string& input) { type_k = input; }
+    void Model::setTypeV(const std::string& input) { type_v = input; }
+    void Model::setFlashAttn(const std::string& input) { flash_attn = input; }
+    void Model::setIdleUnload(const int input) { idle_unload = input; }
+    void Model::setUnloadWeights(const bool input) { unload_weights = input; }
+    void Model::setPerfLog(const std::string& input) { perf_log = input; }
+    void Model::setSessionFile(const std::string& input) { session_file = input; }
+    void Model::setSessionInterval(const int input) { session_interval = input; }
+    void Model::setSessions(const int input) { sessions = input; }
+    void Model::setParallel(const int input) { parallel = input; }
+    void Model::setMaxTokens(const int input) { max_tokens = input; }
+    void Model::setCompletionHook(const CompletionHook& input) { completion_hook = input; }
+    void Model::setStopSequences(const std::vector<std::string>& input) { stop_sequences = input; }
+    void Model::setMessages(const std::vector<chat_messages>& messages) {
+        this->messages = messages;
+        // the new history has to be evaluated from the start
+        if (ctx) {
+            std::lock_guard<std::recursive_mutex> lock(*ctx_mutex);
+            prefillSystem();
+        }
+    }
 
     std::string Model::getModelName() const { return model_name; }
     std::string Model::getModelPurpose() const { return model_purpose; }
@@ -222,5 +1822,40 @@
     int Model::getNCTX() const { return n_ctx; }
     int Model::getKeepHistory() const { return keepHistory; }
     int Model::getVerbose() const { return isVerbose; }
+    std::string Model::getCacheDir() const { return cache_dir; }
+    std::string Model::getContextGroup() const { return context_group; }
+    int Model::getSeqId() const { return seq_id; }
+    std::string Model::getGrammar() const { return grammar; }
+    std::string Model::getDraftPath() const { return draft_path; }
+    int Model::getNDraft() const { return n_draft; }
+    int Model::getLookupNgram() const { return lookup_ngram; }
+    std::string Model::getContextPolicy() const { return context_policy; }
+    int Model::getSummaryBudget() const { return summary_budget; }
+    int Model::getSummaryIdle() const { return summary_idle; }
+    int Model::getNBatch() const { return n_batch; }
+    int Model::getNUbatch() const { return n_ubatch; }
+    int Model::getNThreads() const { return n_threads; }
+    int Model::getNThreadsBatch() const { return n_threads_batch; }
+    int Model::getMaxTokens() const { return max_tokens; }
+    Model::CompletionHook Model::getCompletionHook() const { return completion_hook; }
+    std::vector<std::string> Model::getStopSequences() const { return stop_sequences; }
+    Model::DraftStats Model::getDraftStats() const { return draft_stats; }
+    Model::MemoryUsage Model::getMemoryUsage() const { return memory_usage; }
+    Model::PerfStats Model::getLastPerf() const { return last_perf; }
+    std::string Model::getPerfLog() const { return perf_log; }
+    std::string Model::getSessionFile() const { return session_file; }
+    int Model::getSessionInterval() const { return session_interval; }
+    int Model::getSessions() const { return sessions; }
+    int Model::getParallel() const { return parallel; }
+    std::string Model::getTypeK() const { return type_k; }
+    std::string Model::getTypeV() const { return type_v; }
+    std::string Model::getFlashAttn() const { return flash_attn; }
+    int Model::getIdleUnload() const { return idle_unload; }
+    bool Model::getUnloadWeights() const { return unload_weights; }
+    bool Model::isLoaded() const {
+        if (!ctx_mutex) return false;
+        std::lock_guard<std::recursive_mutex> lock(*ctx_mutex);
+        return ctx != nullptr;
+    }
     std::vector<Model::chat_messages> Model::getMessages() const { return messages; }
     
\ No newline at end of file
@@ -7,8 +7,23 @@
 #include <vector>
 #include <cstring>
 #include <memory>
+#include <string_view>
+#include <algorithm>
+#include <filesystem>
+#include <mutex>
+#include <functional>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <map>
+#include <fstream>
 
 #include "llama.h"
+#include "modelRegistry.h"
+
+class BatchScheduler;
 
 
 /*
@@ -24,8 +39,38 @@
     const float typical             || Typical sampling parameter, 0.0 for no typical, 0.95 for typical sampling
     const float dist                || Distribution parameter for sampling, 0.0 for no distribution, LLAMA_DEFAULT_SEED for default distribution
     const int top_k                 || Top-k sampling parameter, choose only the most probable k tokens
-    const bool keepHistory          || Whether to keep the chat history
+    const bool keepHistory          || Whether to keep the chat history, otherwise every request starts from the system message
     const bool isVerbose            || Return verbose strings
+    std::string cache_dir           || Directory to cache the evaluated system message in, empty to disable (setter only)
+    std::string context_group       || Context shared with other models as separate sequences, empty for an own context (setter only)
+    std::string grammar             || GBNF grammar with a "root" rule constraining the output, empty for free text (setter only)
+    std::string draft_path          || Draft model for speculative decoding, it has to share the vocabulary, empty to disable (setter only)
+    int n_draft                     || Maximum number of tokens drafted per step (setter only)
+    int lookup_ngram                || Without a draft model, draft by matching the last n tokens against the prompt and history, 0 to disable (setter only)
+    std::string context_policy      || When the context is full: "none" fails, "shift" discards the oldest tokens,
+                                       "compact" drops the oldest turns before a prompt and shifts during generation (setter only)
+    int summary_budget              || History tokens after which old turns are summarized while idle, 0 to disable (setter only)
+    int summary_idle                || Seconds without requests before the summary runs (setter only)
+    int max_tokens                  || Maximum number of generated tokens per response, 0 for no limit (setter only)
+    std::vector<std::string> stop   || Strings that end the response, they are not part of it (setter only)
+    int n_batch                     || Tokens per decode call, 0 for n_ctx, AUTO for n_ubatch (setter only)
+    int n_ubatch                    || Tokens per compute step, bounds the compute buffer, 0 for the llama.cpp default, AUTO to benchmark (setter only)
+                                       Models of a context group use the batch sizes declared for the group instead
+    int n_threads                   || Threads generating single tokens, 0 for the llama.cpp default, AUTO to benchmark (setter only)
+    int n_threads_batch             || Threads prefilling prompts, 0 for the llama.cpp default, AUTO to benchmark (setter only)
+                                       Benchmarked settings are kept in cache_dir/tuning.json
+    std::string type_k              || Data type of the K cache: "f32", "f16", "bf16", "q8_0", "q5_1", "q5_0", "q4_1", "q4_0" or "iq4_nl" (setter only)
+    std::string type_v              || Data type of the V cache, the same types, quantized types need flash attention (setter only)
+    std::string flash_attn          || Flash attention "on", "off", or "auto" to use it where the backend supports it (setter only)
+    int idle_unload                 || Seconds without requests after which the context is freed, 0 to keep it (setter only)
+    bool unload_weights             || Whether unloading frees the weights as well, they are memory mapped and reload from the page cache (setter only)
+    int sessions                    || Conversations held in the context at once, the KV state of older ones is parked on disk (setter only)
+    int parallel                    || Requests of a model without history generated together in one batch, 1 to generate one at a time (setter only)
+                                       Each request gets a sequence of n_ctx tokens in the model's context, without a context group, sessions, draft or lookup
+    std::string session_file        || File the chat session is kept in across restarts, empty to disable (setter only)
+    int session_interval            || Seconds between saves after a response, 0 to only save when the model is destroyed (setter only)
+    std::string perf_log            || File every generation appends its timings to as a JSON line, empty to disable (setter only)
+    CompletionHook completion_hook  || Returns text the response has to continue with instead of sampling it, empty to disable (setter only)
 */
 class Model {
     private:
@@ -35,11 +80,6 @@ class Model {
     };
 
     // Deleters for llama model components
-    struct LlamaModelDeleter {
-        void operator()(llama_model* m) const {
-            if (m) llama_model_free(m);
-        }
-    };
     struct LlamaContextDeleter {
         void operator()(llama_context* c) const {
             if (c) llama_free(c);
@@ -65,23 +105,335 @@ class Model {
     std::string init_message = "";
     bool keepHistory = false; // whether to keep the chat history
     bool isVerbose = false; // whether to return verbose strings
+    std::string cache_dir = ""; // directory for the evaluated system message, empty to disable
+    std::string grammar = ""; // GBNF grammar the output has to follow, empty for free text
+    std::string context_policy = "none"; // what to do when the context is full: "none", "shift" or "compact"
+    int summary_budget = 0; // history tokens after which old turns are summarized, 0 to disable
+    int summary_idle = 60; // seconds without requests before the summary runs
+    int max_tokens = 0; // generated tokens per response, 0 for no limit
+    std::vector<std::string> stop_sequences; // strings that end the response
+
+    // Background summary of the history
+    struct Compaction {
+        std::thread worker;
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool stop = false;
+        std::atomic<bool> abort{false}; // set while a request waits for the context
+        std::chrono::steady_clock::time_point last_used;
+    };
+    std::unique_ptr<Compaction> compaction;
 
     // Pointers to the model components
-    std::unique_ptr<llama_model, LlamaModelDeleter> model;
-    std::unique_ptr<llama_context, LlamaContextDeleter> ctx;
+    std::shared_ptr<llama_model> model; // shared through the ModelRegistry
+    std::shared_ptr<llama_context> ctx; // owned, or shared with the other models of the context group
+    std::shared_ptr<std::recursive_mutex> ctx_mutex; // guards the context while a request is evaluated
+    std::shared_ptr<ModelRegistry::SharedContext> shared_ctx;
+    std::string context_group = ""; // name of the shared context, empty for an own context
+    llama_seq_id seq_id = 0; // sequence of the conversation in the context
     std::unique_ptr<llama_sampler, LlamaSamplerDeleter> smpl;
     const llama_vocab *vocab = nullptr; // managed by llama.cpp
 
     std::vector<chat_messages> messages;
+    int prev_len = 0; // length of the formatted chat that is already evaluated in the context
+    int checkpoint_len = 0; // length of the formatted system message
+    llama_pos checkpoint_pos = 0; // position in the context where the system message ends
+
+    /*
+        Decodes the system message and records the checkpoint every request rolls back to.
+    */
+    void prefillSystem();
+
+    // Batch and thread settings, 0 for the default and AUTO to benchmark them at init
+    int n_batch = 0; // tokens per decode call
+    int n_ubatch = 0; // tokens per compute step
+    int n_threads = 0; // threads generating single tokens
+    int n_threads_batch = 0; // threads prefilling prompts
+    int threads = 0; // thread count the context runs with
+    int threads_batch = 0; // batch thread count the context runs with
+
+    // KV cache layout
+    std::string type_k = "f16"; // data type of the K cache
+    std::string type_v = "f16"; // data type of the V cache
+    std::string flash_attn = "auto"; // "on", "off" or "auto"
+
+    /*
+        Converts the name of a KV cache data type.
+        std::string &name             || Type name such as "f16" or "q8_0"
+        returns                       || ggml type
+    */
+    static ggml_type cacheType(const std::string &name);
+
+    // Unloading while idle, the conversation is kept in a state file until the next request
+    int idle_unload = 0; // seconds without requests before unloading, 0 to disable
+    bool unload_weights = false; // whether unloading frees the weights as well
+    llama_context_params context_params{}; // parameters the context is created with again on reload
+    std::string state_file = ""; // saved sequence of an unloaded model
+
+    std::string perf_log = ""; // JSON lines file of the generation timings, empty to disable
+
+    // Chat session kept across restarts, the KV state is restored with the history so nothing is prefilled again
+    static constexpr uint32_t SESSION_VERSION = 1; // format of the session file, files of other versions are ignored
+    std::string session_file = ""; // file the session is saved to and restored from at init, empty to disable
+    int session_interval = 0; // seconds between saves after a response, 0 to only save when the model is destroyed
+    std::chrono::steady_clock::time_point session_saved; // time of the last save or restore
+
+    // Conversations of several users over the same weights, the members above hold the active one
+    struct Conversation {
+        std::vector<chat_messages> messages;
+        std::vector<llama_token> seq_tokens;
+        int prev_len = 0;
+        int checkpoint_len = 0;
+        llama_pos checkpoint_pos = 0;
+        llama_seq_id seq_id = -1; // sequence holding the conversation, -1 while its KV state is parked on disk
+        std::string state_file = ""; // saved sequence of a parked conversation, empty to evaluate the history again
+        std::chrono::steady_clock::time_point last_used;
+    };
+    int sessions = 1; // conversations held in the context at once
+    int parallel = 1; // requests generated together, only for models without history
+    std::shared_ptr<BatchScheduler> scheduler; // batches concurrent requests in the sequences before seq_id, null if parallel is 1 or unloaded
+    std::vector<llama_seq_id> seq_slots; // sequences of the model in the context
+    std::string active_session = ""; // name of the active conversation, "" for the default one
+    std::map<std::string, Conversation> conversations; // the inactive conversations
+
+    /*
+        Makes the conversation active, a new one starts from the system message.
+        std::string &session  || Name of the conversation
+    */
+    void switchSession(const std::string &session);
+    /*
+        Returns a sequence no conversation is held in, parking the least recently used conversation if there is none.
+    */
+    llama_seq_id freeSequence();
+    /*
+        Saves the sequence of an inactive conversation to disk and frees it.
+        Conversation &conv    || Conversation to park
+    */
+    void parkConversation(Conversation &conv);
+
+    /*
+        Acquires the weights and the vocabulary.
+    */
+    void loadWeights();
+    /*
+        Creates the context from context_params, or joins the shared context of the group.
+    */
+    void createContext();
+    /*
+        Builds the sampler chain, including the grammar.
+    */
+    void createSampler();
+    /*
+        Builds a new sampler chain from the sampling settings.
+        returns               || Sampler chain owned by the caller
+    */
+    llama_sampler *buildSampler() const;
+    /*
+        Loads the draft model and creates its context.
+    */
+    void createDraft();
+    /*
+        Loads the model again if it was unloaded, restoring the saved sequence. Called with the context locked.
+    */
+    void ensureLoaded();
+
+    /*
+        Resolves the batch sizes before the context is created, benchmarking n_ubatch in scratch contexts.
+        llama_context_params &params  || Context parameters to fill in
+    */
+    void tuneBatch(llama_context_params &params);
+    /*
+        Resolves the thread counts of the context, benchmarking them on the sequence of this model.
+        llama_context_params &params  || Parameters the context was created with
+    */
+    void tuneThreads(const llama_context_params &params);
+    /*
+        Times decoding a batch into an empty sequence, the sequence is empty afterwards as well.
+        llama_context *context        || Context to decode into
+        llama_seq_id seq              || Sequence to use
+        int n_tokens                  || Number of tokens per batch
+        int n_runs                    || Number of timed runs
+        returns                       || Fastest run in seconds
+    */
+    static double benchmarkDecode(llama_context *context, const llama_seq_id seq, const int n_tokens, const int n_runs);
+    /*
+        Key of the tuning results of this model in the tuning cache.
+        It holds every setting that changes the decode cost: batch sizes, KV cache types and flash attention.
+    */
+    std::string tuningKey() const;
+    /*
+        Reads a benchmarked setting from cache_dir/tuning.json.
+        std::string &setting          || Name of the setting
+        returns                       || Cached value, AUTO if there is none
+    */
+    int cachedTuning(const std::string &setting) const;
+    /*
+        Writes a benchmarked setting to cache_dir/tuning.json.
+        std::string &setting          || Name of the setting
+        int value                     || Benchmarked value
+    */
+    void storeTuning(const std::string &setting, const int value) const;
+    std::vector<llama_token> seq_tokens; // tokens evaluated in the sequence, the index is the position
+
+    // Speculative decoding with a small draft model
+    std::string draft_path = ""; // path to the draft model file, empty to disable
+    int n_draft = 8; // maximum number of drafted tokens per step
+    std::shared_ptr<llama_model> draft_model;
+    std::shared_ptr<llama_context> draft_ctx;
+    std::unique_ptr<llama_sampler, LlamaSamplerDeleter> draft_smpl;
+    std::vector<llama_token> draft_tokens; // tokens evaluated in the draft context
+    int lookup_ngram = 0; // n-gram size for drafting from the sequence itself when there is no draft model, 0 to disable
+
+    /*
+        Decodes tokens at the end of the sequence, split into decode calls of at most n_batch tokens.
+        llama_token *tokens   || Tokens to decode
+        int n_tokens          || Number of tokens
+        bool all_logits       || Compute logits for every token instead of only the last one, the tokens have to fit into one call
+    */
+    void decode(const llama_token *tokens, const int n_tokens, const bool all_logits = false);
+    /*
+        Decodes tokens of one sequence into a context starting at the given position.
+        llama_context *context    || Context to decode into
+        llama_token *tokens       || Tokens to decode
+        int n_tokens              || Number of tokens
+        llama_pos pos             || Position of the first token
+        llama_seq_id seq          || Sequence of the tokens
+        bool all_logits           || Compute logits for every token instead of only the last one
+    */
+    static void decodeBatch(llama_context *context, const llama_token *tokens, const int n_tokens,
+                            const llama_pos pos, const llama_seq_id seq, const bool all_logits);
+    /*
+        Discards the oldest tokens after the system message and shifts the remaining positions back.
+        int n_tokens          || Number of tokens that have to fit afterwards
+        returns               || false if the context can not be shifted
+    */
+    bool shiftContext(const int n_tokens);
+    /*
+        Drops the oldest turns from the history until it fits into the context with room for a response.
+        The remaining history is evaluated again with the next prompt.
+    */
+    void compactHistory();
+    /*
+        Runs summarizeHistory whenever the model was idle for summary_idle seconds.
+    */
+    void compactionWorker();
+    /*
+        Removes all tokens from the given position on from the sequence.
+        llama_pos n_keep      || Number of tokens to keep
+    */
+    void truncate(const llama_pos n_keep);
+    /*
+        Drafts a continuation of the sequence and the sampled token with the draft model.
+        llama_token last      || Sampled token that is not evaluated yet
+        returns               || Drafted tokens, empty if speculative decoding is disabled
+    */
+    std::vector<llama_token> draftTokens(const llama_token last);
+    /*
+        Drafts a continuation by finding the last n-gram earlier in the sequence, no extra model needed.
+        llama_token last      || Sampled token that is not evaluated yet
+        returns               || Tokens that followed the earlier occurrence, empty if there is none
+    */
+    std::vector<llama_token> lookupTokens(const llama_token last) const;
+    /*
+        Context size available to the sequence of this model.
+    */
+    int contextSize() const;
+    /*
+        Decodes the prompt into the context without sampling.
+        std::string &prompt   || Input prompt string
+        returns               || Decoded prompt tokens
+    */
+    std::vector<llama_token> prefill(const std::string &prompt);
+    /*
+        Builds the cache file path of the system message, keyed by model file, prompt and context parameters.
+        std::string &system   || Formatted system message
+        returns               || Path of the cache file
+    */
+    std::string cacheFilePath(const std::string &system) const;
+    /*
+        Tokenizes the prompt, adding the BOS token only to an empty context.
+        std::string &prompt   || Input prompt string
+        returns               || Prompt tokens
+    */
+    std::vector<llama_token> tokenize(const std::string &prompt) const;
+    /*
+        Formats the messages with the chat template of the model.
+        std::vector<chat_messages> &msgs  || Messages to format
+        bool add_ass                      || Whether to end with the assistant prefix
+        returns                           || Formatted chat string
+    */
+    std::string applyTemplate(const std::vector<chat_messages> &msgs, const bool add_ass) const;
+    /*
+        Model file and context settings a saved KV state is only valid for, as a JSON string.
+    */
+    std::string sessionParams() const;
+
+    public:
+    // Speculative decoding statistics
+    struct DraftStats {
+        size_t drafted = 0; // tokens proposed by the draft model
+        size_t accepted = 0; // drafted tokens the model sampled as well
+        float acceptanceRate() const { return drafted ? (float)accepted / drafted : 0.0f; }
+    };
+
+    /*
+        Continuation of a response that is known without sampling it.
+        text                  || Literal text the response continues with
+        complete              || Whether the response ends after the text
+    */
+    struct Completion {
+        std::string text;
+        bool complete = false;
+    };
+    /*
+        Called after every sampled token.
+        std::string &response || Response generated so far
+        returns               || Text the response has to continue with, empty text to keep sampling
+    */
+    using CompletionHook = std::function<Completion(const std::string &response)>;
+
+    // Memory used by the model, reported at init
+    struct MemoryUsage {
+        uint64_t weights = 0; // bytes of the model weights, shared with other models using the same file
+        uint64_t kv_cache = 0; // bytes of the KV cache of this model's sequence
+    };
+
+    // Timings of the last generation, prompt evaluation included
+    struct PerfStats {
+        int prompt_tokens = 0; // tokens of the prompt evaluated
+        int generated_tokens = 0; // tokens added to the response, forced ones included
+        double prefill_ms = 0; // evaluating the prompt
+        double decode_ms = 0; // evaluating the generated tokens, rejected draft tokens included
+        double sample_ms = 0; // in the sampler chain
+        double ttft_ms = 0; // from the request to the first generated token
+        double total_ms = 0; // from the request to the end of the response
+        double prefillTokensPerSecond() const { return prefill_ms > 0 ? prompt_tokens * 1000.0 / prefill_ms : 0.0; }
+        double decodeTokensPerSecond() const { return decode_ms > 0 ? generated_tokens * 1000.0 / decode_ms : 0.0; }
+    };
+
+    private:
+    DraftStats draft_stats;
+    MemoryUsage memory_usage;
+    uint64_t kv_bytes_per_token = 0; // K and V rows of all layers for one position
+    PerfStats last_perf;
+    bool internal_request = false; // the summary is generated, its timings are not reported as a request
+    /*
+        Appends the timings as one JSON line to perf_log.
+        PerfStats &perf       || Timings of a generation
+    */
+    void logPerf(const PerfStats &perf) const;
+    CompletionHook completion_hook; // literal continuations of the response, empty to always sample
 
     public:
+    static constexpr int AUTO = -1; // batch or thread setting that is benchmarked at init
+
     Model(const Model&) = delete; // Copy constructor is not supported by llama.cpp
     Model& operator=(const Model&) = delete; // Copy operator is not supported by llama.cpp
-    Model(Model&&) = default; // Move constructor
-    Model& operator=(Model&&) = default; // Move assignment operator
+    Model(Model&&) = delete; // background threads and the MemoryManager keep the address of the model
+    Model& operator=(Model&&) = delete;
 
     Model() = default;
-    ~Model() = default;
+    ~Model();
     Model(const std::string &name, const std::string &purpose, const std::string &path, 
             const int ngl, const int n_ctx, const std::string &init_msg, 
             const float temp, const float min_p, const float top_p, 
@@ -91,20 +443,156 @@ class Model {
         Initializes the model by loading it from the specified path and setting up the context and sampler.
     */
     void init();
+    /*
+        Receives generated text as soon as it is sampled, always ending on a complete UTF-8 character.
+        std::string &piece    || Generated text since the last call
+        returns               || false to stop the generation
+    */
+    using TokenCallback = std::function<bool(const std::string &piece)>;
+    /*
+        Overrides the generation limits of the model for a single request.
+        max_tokens            || Maximum number of generated tokens, 0 for no limit
+        stop                  || Strings that end the response
+    */
+    struct GenerationOptions {
+        std::optional<int> max_tokens;
+        std::optional<std::vector<std::string>> stop;
+    };
+    /*
+        Length of the text up to its last complete UTF-8 character.
+        std::string &text     || Text that may end in the middle of a character
+        returns               || Number of bytes that can be passed on
+    */
+    static size_t utf8CompleteLength(const std::string &text);
+    /*
+        Cuts the response at a stop sequence, only the end of the response can contain a new one.
+        std::string &response             || Response with the last piece appended
+        size_t piece_size                 || Length of the last piece
+        std::vector<std::string> &stops   || Strings that end the response
+        bool &stopped                     || Set when a stop sequence was found
+        returns                           || Bytes at the end that may be the start of a stop sequence and have to be held back
+    */
+    static size_t matchStop(std::string &response, const size_t piece_size, const std::vector<std::string> &stops, bool &stopped);
+    /*
+        Finds the n-gram the tokens end with earlier in them, longer n-grams are tried first, down to 2 tokens.
+        std::vector<llama_token> &tokens  || Evaluated sequence
+        llama_token last                  || Sampled token that follows the sequence
+        int ngram                         || Longest n-gram to look up
+        int n_max                         || Maximum number of tokens returned
+        returns                           || Tokens that followed the earlier occurrence, empty if there is none
+    */
+    static std::vector<llama_token> lookupNgram(const std::vector<llama_token> &tokens, const llama_token last, const int ngram, const int n_max);
+    /*
+        Tokens a context shift discards after the kept ones, half of the rest or as many as the new tokens need.
+        int n_keep            || Tokens that stay at the start, the system message
+        int n_used            || Tokens in the sequence
+        int n_tokens          || Tokens that have to fit afterwards
+        int n_ctx             || Context size of the sequence
+        returns               || Number of tokens to discard, 0 if shifting can not make room
+    */
+    static int shiftDiscard(const int n_keep, const int n_used, const int n_tokens, const int n_ctx);
+
+    private:
+    /*
+        Generates the response in a slot of the batch scheduler, the context mutex is only held to submit and to record the timings.
+    */
+    std::string respondBatched(const std::string &prompt, const TokenCallback &onPiece, const GenerationOptions &options);
+
+    public:
+
     /*
         Generates a response based on the given prompt.
         std::string &prompt   || Input prompt string
         returns               || Generated response string
     */
     std::string generate(const std::string &prompt);
+    /*
+        Generates a response based on the given prompt, streaming it through the callback.
+        std::string &prompt       || Input prompt string
+        TokenCallback &onPiece    || Called with each generated piece, nullptr to only return the response
+        GenerationOptions &options || Limits overriding the ones of the model
+        returns                   || Generated response string
+    */
+    std::string generate(const std::string &prompt, const TokenCallback &onPiece, const GenerationOptions &options = {});
     /*
         Responds to the given prompt, managing chat history if enabled.
         std::string &prompt   || Input prompt string
         returns               || Generated response string
     */
     std::string respond(const std::string &prompt);
+    /*
+        Responds to the given prompt, streaming the response through the callback.
+        std::string &prompt       || Input prompt string
+        TokenCallback &onPiece    || Called with each generated piece, nullptr to only return the response
+        GenerationOptions &options || Limits overriding the ones of the model
+        returns                   || Generated response string
+    */
+    std::string respond(const std::string &prompt, const TokenCallback &onPiece, const GenerationOptions &options = {});
+    /*
+        Responds within a conversation of its own, for example of another user or room.
+        respond continues the default conversation "".
+        std::string &session      || Name of the conversation, created on first use
+        std::string &prompt       || Input prompt string
+        TokenCallback &onPiece    || Called with each generated piece, nullptr to only return the response
+        GenerationOptions &options || Limits overriding the ones of the model
+        returns                   || Generated response string
+    */
+    std::string respondInSession(const std::string &session, const std::string &prompt, const TokenCallback &onPiece = nullptr,
+                                 const GenerationOptions &options = {});
+    /*
+        Forgets a conversation and its parked state, the default conversation is cleared instead.
+        std::string &session      || Name of the conversation
+    */
+    void endSession(const std::string &session);
+    /*
+        Names of all conversations, the default one included.
+    */
+    std::vector<std::string> getSessionNames() const;
+    /*
+        Replaces all but the last turn of the history with a summary in the system message once the history exceeds summary_budget tokens.
+        The evaluated history is kept if the summary fails or is interrupted.
+        Runs in the background when summary_budget is set.
+        returns               || true if the history was summarized
+    */
+    bool summarizeHistory();
+    /*
+        Frees the context, and the weights if unload_weights is set, after saving the evaluated conversation.
+        The next request loads the model again. Called by the MemoryManager while the model is idle.
+        returns               || false if the model is in use or already unloaded
+    */
+    bool unload();
+    /*
+        Saves the chat history together with the evaluated conversation of the sequence, written to a temporary file first.
+        Without a context, while unloaded, only the history is saved.
+        std::string &path     || Session file, empty for session_file
+        returns               || false if there is no history or the file could not be written
+    */
+    bool saveSession(const std::string &path = "");
+    /*
+        Restores a saved chat session, called by init when session_file exists.
+        The KV state is only used if the model file, context size, cache types and system message match,
+        otherwise the restored history is evaluated again with the next prompt.
+        std::string &path     || Session file, empty for session_file
+        returns               || false if the file is missing, unreadable or of another version, nothing is changed then
+    */
+    bool restoreSession(const std::string &path = "");
+    /*
+        Memory the model needs while it is loaded, 0 while the model is unloaded.
+    */
+    uint64_t residentMemory() const;
+    /*
+        Memory that unloading the model frees now. A shared context or weights that another holder keeps alive are not counted.
+        returns               || Bytes, 0 while the model is unloaded or generating
+    */
+    uint64_t freeableMemory() const;
+    /*
+        Loaded context and weights of the model, keyed by what holds them so models sharing them report the same key.
+        Called while the model holds its context.
+    */
+    std::vector<std::pair<const void*, uint64_t>> memoryResources() const;
     /*
         Clears the chat history, retaining only the initial system message.
+        Also removes the evaluated conversation from the context.
     */
     void clearHistory();
 
@@ -123,6 +611,37 @@ class Model {
     int getNCTX() const;
     int getKeepHistory() const;
     int getVerbose() const;
+    std::string getCacheDir() const;
+    std::string getContextGroup() const;
+    int getSeqId() const;
+    std::string getGrammar() const;
+    std::string getDraftPath() const;
+    int getNDraft() const;
+    int getLookupNgram() const;
+    std::string getContextPolicy() const;
+    int getSummaryBudget() const;
+    int getSummaryIdle() const;
+    int getNBatch() const;
+    int getNUbatch() const;
+    int getNThreads() const;
+    int getNThreadsBatch() const;
+    int getMaxTokens() const;
+    CompletionHook getCompletionHook() const;
+    std::vector<std::string> getStopSequences() const;
+    DraftStats getDraftStats() const;
+    MemoryUsage getMemoryUsage() const;
+    PerfStats getLastPerf() const;
+    std::string getPerfLog() const;
+    std::string getSessionFile() const;
+    int getSessionInterval() const;
+    int getSessions() const;
+    int getParallel() const;
+    std::string getTypeK() const;
+    std::string getTypeV() const;
+    std::string getFlashAttn() const;
+    int getIdleUnload() const;
+    bool getUnloadWeights() const;
+    bool isLoaded() const;
     std::vector<chat_messages> getMessages() const;
 
     // Setters
@@ -140,6 +659,32 @@ class Model {
     void setTopK(const int top_k);
     void setKeepHistory(const bool keepHistory);
     void setVerbose(const bool isVerbose);
+    void setCacheDir(const std::string &cache_dir);
+    void setContextGroup(const std::string &context_group);
+    void setGrammar(const std::string &grammar);
+    void setDraftPath(const std::string &draft_path);
+    void setNDraft(const int n_draft);
+    void setLookupNgram(const int lookup_ngram);
+    void setContextPolicy(const std::string &context_policy);
+    void setSummaryBudget(const int summary_budget);
+    void setSummaryIdle(const int summary_idle);
+    void setNBatch(const int n_batch);
+    void setNUbatch(const int n_ubatch);
+    void setNThreads(const int n_threads);
+    void setNThreadsBatch(const int n_threads_batch);
+    void setTypeK(const std::string &type_k);
+    void setTypeV(const std::string &type_v);
+    void setFlashAttn(const std::string &flash_attn);
+    void setIdleUnload(const int idle_unload);
+    void setUnloadWeights(const bool unload_weights);
+    void setPerfLog(const std::string &perf_log);
+    void setSessionFile(const std::string &session_file);
+    void setSessionInterval(const int session_interval);
+    void setSessions(const int sessions);
+    void setParallel(const int parallel);
+    void setMaxTokens(const int max_tokens);
+    void setCompletionHook(const CompletionHook& completion_hook);
+    void setStopSequences(const std::vector<std::string>& stop_sequences);
     void setMessages(const std::vector<chat_messages>& messages);
 };
 
@@ -0,0 +1,144 @@
+#include "modelRegistry.h"
+
+#include <algorithm>
+
+namespace {
+    std::mutex registryMutex;
+    // weights by file, the mutex is held while the file is loaded so different files load in parallel
+    struct LoadedModel {
+        std::weak_ptr<llama_model> model;
+        std::shared_ptr<std::mutex> loading = std::make_shared<std::mutex>();
+    };
+    std::map<std::string, LoadedModel> models;
+    std::once_flag backendInit;
+
+    struct ContextGroup {
+        int n_seq_max = 1;
+        int n_ctx = 0;
+        int n_batch = 0;
+        int n_ubatch = 0;
+        std::weak_ptr<ModelRegistry::SharedContext> shared;
+        std::shared_ptr<std::recursive_mutex> mtx = std::make_shared<std::recursive_mutex>();
+    };
+    std::map<std::string, ContextGroup> contextGroups;
+}
+
+std::shared_ptr<llama_model> ModelRegistry::acquireModel(const std::string& path, const int ngl) {
+    std::call_once(backendInit, []() {
+        // disables metadata dumping
+        llama_log_set([](ggml_log_level, const char *, void *) {}, nullptr);
+
+        // load dynamic backends
+        ggml_backend_load_all();
+    });
+
+    std::string key = std::filesystem::absolute(path).lexically_normal().string() + "|" + std::to_string(ngl);
+
+    std::shared_ptr<std::mutex> loading;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        loading = models[key].loading;
+    }
+    std::lock_guard<std::mutex> loadingLock(*loading);
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        if (auto loaded = models[key].model.lock()) {
+            return loaded;
+        }
+    }
+
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = ngl;
+    model_params.use_mmap = true; // the weights stay in the page cache, reloading an unloaded model is cheap
+
+    std::shared_ptr<llama_model> model(llama_model_load_from_file(path.c_str(), model_params), [](llama_model* m) {
+        if (m) llama_model_free(m);
+    });
+    if (!model) {
+        throw std::runtime_error("Failed to load model");
+    }
+    std::lock_guard<std::mutex> lock(registryMutex);
+    models[key].model = model;
+    return model;
+}
+
+size_t ModelRegistry::loadedModels() {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    size_t count = 0;
+    for (const auto& [key, loaded] : models) {
+        if (!loaded.model.expired()) count++;
+    }
+    return count;
+}
+
+void ModelRegistry::declareContextGroup(const std::string& group, const int n_seq_max, const int n_ctx, const int n_batch, const int n_ubatch) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    contextGroups[group].n_seq_max = n_seq_max;
+    contextGroups[group].n_ctx = n_ctx;
+    contextGroups[group].n_batch = n_batch;
+    contextGroups[group].n_ubatch = n_ubatch;
+}
+
+std::shared_ptr<ModelRegistry::SharedContext> ModelRegistry::acquireContext(const std::string& group, const std::shared_ptr<llama_model>& model,
+                                                                            llama_context_params params, llama_seq_id& seq_id) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    auto it = contextGroups.find(group);
+    if (it == contextGroups.end()) {
+        throw std::runtime_error("Context group is not declared: " + group);
+    }
+    ContextGroup& contextGroup = it->second;
+
+    std::shared_ptr<SharedContext> shared = contextGroup.shared.lock();
+    if (!shared) {
+        // one KV cache for all sequences, each model limits its own sequence to its n_ctx
+        params.n_ctx = contextGroup.n_ctx;
+        params.n_seq_max = contextGroup.n_seq_max;
+        params.kv_unified = true;
+        if (contextGroup.n_batch > 0) {
+            params.n_batch = std::min(contextGroup.n_batch, contextGroup.n_ctx);
+        }
+        if (contextGroup.n_ubatch > 0) {
+            params.n_ubatch = std::min<uint32_t>(contextGroup.n_ubatch, params.n_batch);
+        }
+
+        shared = std::make_shared<SharedContext>();
+        shared->ctx.reset(llama_init_from_model(model.get(), params), [](llama_context* c) {
+            if (c) llama_free(c);
+        });
+        if (!shared->ctx) {
+            throw std::runtime_error("Failed to create shared context for group: " + group);
+        }
+        shared->model = model;
+        shared->mtx = contextGroup.mtx;
+        shared->seqUsed.assign(contextGroup.n_seq_max, false);
+        shared->params = params;
+        contextGroup.shared = shared;
+    } else if (shared->model != model) {
+        throw std::runtime_error("Models of context group " + group + " do not use the same weights");
+    } else if (shared->params.type_k != params.type_k || shared->params.type_v != params.type_v ||
+               shared->params.flash_attn_type != params.flash_attn_type) {
+        // the KV cache is one for all sequences, the settings of whichever model came first would silently win
+        throw std::runtime_error("Models of context group " + group + " use different KV cache types or flash attention settings");
+    }
+
+    for (size_t i = 0; i < shared->seqUsed.size(); i++) {
+        if (!shared->seqUsed[i]) {
+            shared->seqUsed[i] = true;
+            seq_id = i;
+            return shared;
+        }
+    }
+    throw std::runtime_error("No free sequence left in context group: " + group);
+}
+
+std::shared_ptr<std::recursive_mutex> ModelRegistry::contextMutex(const std::string& group) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    return contextGroups[group].mtx;
+}
+
+void ModelRegistry::releaseContext(const std::shared_ptr<SharedContext>& shared, const llama_seq_id seq_id) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    if (seq_id >= 0 && seq_id < (llama_seq_id)shared->seqUsed.size()) {
+        shared->seqUsed[seq_id] = false;
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef MODELREGISTRY_H
+#define MODELREGISTRY_H
+
+#include <string>
+#include <memory>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <filesystem>
+#include <stdexcept>
+
+#include "llama.h"
+
+namespace ModelRegistry {
+    // A context hosting the conversations of several models as separate sequences
+    struct SharedContext {
+        std::shared_ptr<llama_context> ctx;
+        std::shared_ptr<std::recursive_mutex> mtx; // held while one of the sequences is evaluated, outlives the context
+        std::shared_ptr<llama_model> model; // kept loaded as long as the context exists
+        std::vector<bool> seqUsed; // guarded by the registry
+        llama_context_params params; // parameters the context was created with
+    };
+
+
+    /*
+        Loads the model weights, or returns the already loaded weights for the same file and GPU layers.
+        Different files can be loaded from several threads at once, the same file is only loaded once.
+        The weights are freed once the last Model using them is destroyed.
+        const std::string& path     || Path to the model file
+        const int ngl               || Number of GPU layers, 0 for CPU only
+        returns                     || Shared model weights
+    */
+    std::shared_ptr<llama_model> acquireModel(const std::string& path, const int ngl);
+    /*
+        Number of distinct model weights currently loaded.
+    */
+    size_t loadedModels();
+    /*
+        Declares a shared context before the models of the group are initialized.
+        The batch sizes are merged from all models of the group, so the context does not depend on which model loads first.
+        const std::string& group    || Name of the context group
+        const int n_seq_max         || Number of models sharing the context
+        const int n_ctx             || Total context size in tokens of all sequences
+        const int n_batch           || Tokens per decode call, the largest of the models, 0 for the llama.cpp default
+        const int n_ubatch          || Tokens per compute step, the largest of the models, 0 for the llama.cpp default
+    */
+    void declareContextGroup(const std::string& group, const int n_seq_max, const int n_ctx, const int n_batch = 0, const int n_ubatch = 0);
+    /*
+        Creates the shared context of the group on first use and assigns a free sequence to the caller.
+        Every model of the group has to use the same KV cache types and flash attention setting.
+        const std::string& group                    || Name of the context group
+        const std::shared_ptr<llama_model>& model   || Weights the context is created from
+        llama_context_params params                 || Context parameters of the model, n_ctx, n_seq_max and the batch sizes come from the group
+        llama_seq_id& seq_id                        || Output sequence assigned to the caller
+        returns                                     || Shared context
+    */
+    std::shared_ptr<SharedContext> acquireContext(const std::string& group, const std::shared_ptr<llama_model>& model,
+                                                  llama_context_params params, llama_seq_id& seq_id);
+    /*
+        Mutex of the context group, the same one for every context the group creates.
+        const std::string& group    || Name of the context group
+    */
+    std::shared_ptr<std::recursive_mutex> contextMutex(const std::string& group);
+    /*
+        Returns a sequence of the shared context so another model can use it.
+        const std::shared_ptr<SharedContext>& shared    || Shared context
+        const llama_seq_id seq_id                       || Sequence to release
+    */
+    void releaseContext(const std::shared_ptr<SharedContext>& shared, const llama_seq_id seq_id);
+};
+
+#endif
@@ -1,6 +1,7 @@
 #include "voice.h"
 
 Voice::~Voice() {
+    finishStream();
     if (synth) {
         piper_free(synth);
         synth = nullptr;
@@ -28,32 +29,158 @@ void Voice::init() {
 }
 
 void Voice::speak(std::string text) {
+    std::lock_guard<std::mutex> lock(speakMutex);
     if (isVerbose) std::cout << "Starting synthesis for text: " << text << std::endl;
-    piper_synthesize_start(synth, text.c_str(), &options);
-    piper_audio_chunk chunk;
-    std::vector<float> audio_data;
-    float tempSamples = 0;
+    std::vector<float> audio_data = synthesize(text);
 
     audio_stream.open(fileName, std::ios::binary);
     if (!audio_stream.is_open()) {
         throw std::runtime_error("Failed to open audio output file.");
     }
+    audio_stream.write(reinterpret_cast<const char *>(audio_data.data()),
+                       audio_data.size() * sizeof(float));
+    audio_stream.close();
+    if (audio_data.empty()) {
+        throw std::runtime_error("No audio data was generated.");
+    }
+    std::string playCommand = "aplay -r " + std::to_string(frequency) + " -c 1 -f FLOAT_LE -t raw " + fileName + " -q";
+    system(playCommand.c_str());
+}
+
+std::vector<float> Voice::synthesize(const std::string& text) {
+    std::lock_guard<std::mutex> lock(synthMutex);
+    piper_synthesize_start(synth, text.c_str(), &options);
+    piper_audio_chunk chunk;
+    std::vector<float> audio_data;
+    float tempSamples = 0;
+    const float volume = volumeScale; // one volume for the whole utterance
+
     while (piper_synthesize_next(synth, &chunk) != PIPER_DONE) {
         // Volume scaling
         for (int i = 0; i < chunk.num_samples; i++) {
-            tempSamples = chunk.samples[i] * volumeScale;
+            tempSamples = chunk.samples[i] * volume;
             if (tempSamples > 1.0f) tempSamples = 1.0f;
             if (tempSamples < -1.0f) tempSamples = -1.0f;
-            const_cast<float*>(chunk.samples)[i] = tempSamples;
+            audio_data.push_back(tempSamples);
         }
-        audio_stream.write(reinterpret_cast<const char *>(chunk.samples),
-                           chunk.num_samples * sizeof(float));
-        audio_data.insert(audio_data.end(), chunk.samples, chunk.samples + chunk.num_samples);
     }
-    audio_stream.close();
-    if (audio_data.empty()) {
-        throw std::runtime_error("No audio data was generated.");
+    return audio_data;
+}
+
+void Voice::startStream() {
+    finishStream();
+    if (!synth) {
+        throw std::runtime_error("Voice synthesizer is not initialized.");
     }
-    std::string playCommand = "aplay -r " + std::to_string(frequency) + " -c 1 -f FLOAT_LE -t raw " + fileName + " -q";
-    system(playCommand.c_str());
+    {
+        std::lock_guard<std::mutex> lock(streamMutex);
+        streamOpen = true;
+        synthDone = false;
+    }
+    synthThread = std::thread(&Voice::synthWorker, this);
+    playThread = std::thread(&Voice::playWorker, this);
+}
+
+void Voice::queueSentence(const std::string& sentence) {
+    if (sentence.empty()) return;
+    {
+        std::lock_guard<std::mutex> lock(streamMutex);
+        if (!streamOpen) {
+            throw std::runtime_error("Voice stream is not started.");
+        }
+        sentenceQueue.push(sentence);
+    }
+    streamCv.notify_all();
+}
+
+void Voice::finishStream() {
+    {
+        std::lock_guard<std::mutex> lock(streamMutex);
+        streamOpen = false;
+    }
+    streamCv.notify_all();
+    if (synthThread.joinable()) synthThread.join();
+    if (playThread.joinable()) playThread.join();
+}
+
+void Voice::synthWorker() {
+    while (true) {
+        std::unique_lock<std::mutex> lock(streamMutex);
+        streamCv.wait(lock, [this]() { return !sentenceQueue.empty() || !streamOpen; });
+        if (sentenceQueue.empty()) {
+            synthDone = true;
+            lock.unlock();
+            streamCv.notify_all();
+            return;
+        }
+        std::string sentence = sentenceQueue.front();
+        sentenceQueue.pop();
+        lock.unlock();
+
+        if (isVerbose) std::cout << "Starting synthesis for sentence: " << sentence << std::endl;
+        std::vector<float> audio_data = synthesize(sentence);
+
+        lock.lock();
+        audioQueue.push(std::move(audio_data));
+        lock.unlock();
+        streamCv.notify_all();
+    }
+}
+
+void Voice::playWorker() {
+    // one player for the whole stream so there are no gaps between sentences
+    std::string playCommand = "aplay -r " + std::to_string(frequency) + " -c 1 -f FLOAT_LE -t raw -q -";
+    FILE* player = popen(playCommand.c_str(), "w");
+    if (!player) {
+        std::cerr << "Failed to start audio player." << std::endl;
+    }
+    while (true) {
+        std::unique_lock<std::mutex> lock(streamMutex);
+        streamCv.wait(lock, [this]() { return !audioQueue.empty() || synthDone; });
+        if (audioQueue.empty()) {
+            break;
+        }
+        std::vector<float> audio_data = std::move(audioQueue.front());
+        audioQueue.pop();
+        lock.unlock();
+
+        if (player) {
+            fwrite(audio_data.data(), sizeof(float), audio_data.size(), player);
+            fflush(player);
+        }
+    }
+    if (player) pclose(player);
+}
+
+std::vector<std::string> SentenceSplitter::push(const std::string& piece) {
+    std::vector<std::string> sentences;
+    buffer += piece;
+
+    // a sentence ends at a punctuation mark followed by whitespace, or at a line break
+    size_t start = 0;
+    for (size_t i = 0; i + 1 < buffer.size(); ++i) {
+        char c = buffer[i];
+        bool end = c == '\n' ||
+                   ((c == '.' || c == '!' || c == '?' || c == ':' || c == ';') && std::isspace(static_cast<unsigned char>(buffer[i + 1])));
+        if (end) {
+            std::string sentence = buffer.substr(start, i + 1 - start);
+            size_t first = sentence.find_first_not_of(" \t\r\n");
+            size_t last = sentence.find_last_not_of(" \t\r\n");
+            if (first != std::string::npos) {
+                sentences.push_back(sentence.substr(first, last - first + 1));
+            }
+            start = i + 1;
+        }
+    }
+    buffer.erase(0, start);
+    return sentences;
+}
+
+std::string SentenceSplitter::flush() {
+    std::string rest = buffer;
+    buffer.clear();
+    size_t first = rest.find_first_not_of(" \t\r\n");
+    if (first == std::string::npos) return "";
+    size_t last = rest.find_last_not_of(" \t\r\n");
+    return rest.substr(first, last - first + 1);
 }
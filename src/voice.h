@@ -6,6 +6,30 @@
 #include <vector>
 #include <fstream>
 #include <iostream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <queue>
+#include <cstdio>
+
+// Cuts streamed text into sentences so they can be spoken while the rest is still generated
+class SentenceSplitter {
+private:
+    std::string buffer;
+
+public:
+    /*
+        Adds streamed text and returns the sentences it completes.
+        const std::string& piece    || Text to add
+        returns                     || Completed sentences, without surrounding whitespace
+    */
+    std::vector<std::string> push(const std::string& piece);
+    /*
+        Returns the remaining text, which is not followed by a sentence end, and clears the buffer.
+    */
+    std::string flush();
+};
 
 
 class Voice {
@@ -24,7 +48,27 @@ private:
     float lengthScale;
     float noiseScale;
     float noiseWScale;
-    float volumeScale = 1.0f;
+    std::atomic<float> volumeScale{1.0f}; // set by the caller while the synthesis thread reads it
+
+    // piper keeps the state of one synthesis, speak and the stream take turns
+    std::mutex synthMutex;
+    // speak writes and plays one shared file
+    std::mutex speakMutex;
+
+    // Sentence pipeline, synthesis and playback run on their own threads
+    std::thread synthThread;
+    std::thread playThread;
+    std::mutex streamMutex;
+    std::condition_variable streamCv;
+    std::queue<std::string> sentenceQueue;
+    std::queue<std::vector<float>> audioQueue;
+    bool streamOpen = false;
+    bool synthDone = true;
+
+    // Synthesizes the text into samples with the volume applied
+    std::vector<float> synthesize(const std::string& text);
+    void synthWorker();
+    void playWorker();
 
 public:
     Voice() = default;
@@ -33,6 +77,19 @@ public:
     ~Voice();
     void speak(std::string text);
     void init();
+    /*
+        Starts the sentence pipeline, sentences are synthesized and played in the order they are queued.
+    */
+    void startStream();
+    /*
+        Queues a sentence of the current stream, synthesis starts as soon as the previous sentence is done.
+        const std::string& sentence     || Sentence to speak
+    */
+    void queueSentence(const std::string& sentence);
+    /*
+        Ends the current stream and waits until all queued sentences have been played.
+    */
+    void finishStream();
 
 
     // Setters and Getters
@@ -58,6 +115,7 @@ public:
     float getNoiseWScale() const { return noiseWScale; }
     bool getEnabled() const { return enabled; }
     bool getVerbose() const { return isVerbose; }
+    bool isInitialized() const { return synth != nullptr; }
     float getVolumeScale() const { return volumeScale; }
 };
 
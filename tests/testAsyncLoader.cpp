@@ -0,0 +1,72 @@
+#include <iostream>
+#include <cassert>
+#include <atomic>
+#include <vector>
+
+#include "../src/asyncLoader.h"
+
+
+void testLoadInParallel() {
+    AsyncLoader loader;
+    auto begin = std::chrono::steady_clock::now();
+    loader.start("first", []() { std::this_thread::sleep_for(std::chrono::milliseconds(200)); });
+    loader.start("second", []() { std::this_thread::sleep_for(std::chrono::milliseconds(200)); });
+
+    assert(!loader.isReady("first"));
+    assert(loader.isLoading("first"));
+    assert(!loader.isLoading("unknown"));
+    assert(loader.isReady("unknown")); // components that are never loaded do not hold anything back
+    assert(loader.wait("first"));
+    assert(loader.wait("second"));
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    std::cout << "Loaded both components in " << elapsed.count() << " s" << std::endl;
+    assert(elapsed.count() < 0.39); // both slept at the same time
+}
+
+void testQueueUntilReady() {
+    AsyncLoader loader;
+    std::atomic<bool> loaded = false;
+    std::vector<int> order;
+    loader.start("model", [&loaded]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        loaded = true;
+    });
+
+    // queued work runs after the component is loaded, in the order it was queued
+    loader.whenReady("model", [&]() { assert(loaded); order.push_back(1); });
+    loader.whenReady("model", [&]() { order.push_back(2); });
+    while (loader.pending() > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    assert((order == std::vector<int>{1, 2}));
+}
+
+void testFailedLoad() {
+    AsyncLoader loader;
+    bool ran = false;
+    loader.start("broken", []() { throw std::runtime_error("missing file"); });
+
+    // work of a component that failed to load is dropped
+    assert(!loader.wait("broken"));
+    assert(!loader.isReady("broken"));
+    assert(!loader.isLoading("broken")); // failed, not waiting any more
+    loader.whenReady("broken", [&ran]() { ran = true; });
+    while (loader.pending() > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    assert(!ran);
+}
+
+int main(int argc, char *argv[]) {
+    try { 
+        std::cout << "Running AsyncLoader tests..." << std::endl;
+        testLoadInParallel();
+        testQueueUntilReady();
+        testFailedLoad();
+    } catch (const std::exception& e) {
+        std::cerr << "AsyncLoader Test failed: " << e.what() << std::endl;
+        return 1; // Return a non-zero value to indicate failure
+    }
+    std::cout << "AsyncLoader Tests Passed!" << std::endl;
+    return 0;
+}
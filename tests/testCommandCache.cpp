@@ -0,0 +1,87 @@
+#include <iostream>
+#include <cassert>
+#include <filesystem>
+
+#include "../src/commandCache.h"
+#include "../src/configVars.h"
+
+std::vector<ConfigVars::Commands> testCommands() {
+    return {
+        {"lightsOff", "lightsOff", 0, false, 1, {"turn off the lights"}},
+        {"setVolume", "setVolume", 1, false, 2, {"set volume to <arg0>"}}
+    };
+}
+
+FunctionCall::ParsedPhrase phrase(const std::string& command, const std::vector<std::string>& arguments = {}) {
+    FunctionCall::ParsedPhrase parsed;
+    parsed.command = command;
+    parsed.arguments = arguments;
+    return parsed;
+}
+
+void testNormalize() {
+    assert(CommandCache::normalize("  Lights   OFF, pls! ") == "lights off pls");
+    assert(CommandCache::normalize("lights off pls") == CommandCache::normalize("Lights off pls."));
+    assert(CommandCache::normalize("Can you turn off the lights, please?") == "turn off the lights");
+}
+
+void testLeastRecentlyUsed() {
+    CommandCache cache(2, "", true);
+    cache.load(testCommands());
+    cache.put("lights off pls", "turn off the lights", phrase("lightsOff"));
+    cache.put("louder to 5", "set volume to 5", phrase("setVolume", {"5"}));
+
+    // using the first entry makes the second one the oldest
+    assert(cache.get("Lights off pls!")->parsed.command == "lightsOff");
+    cache.put("volume 3", "set volume to 3", phrase("setVolume", {"3"}));
+    assert(cache.size() == 2);
+    assert(!cache.get("louder to 5"));
+    assert(cache.get("lights off pls"));
+    assert(cache.get("volume 3")->parsed.arguments == std::vector<std::string>{"3"});
+}
+
+void testPersistence() {
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "azazel-command-cache-test.json";
+    std::filesystem::remove(path);
+    {
+        CommandCache cache(8, path.string(), true);
+        cache.load(testCommands());
+        cache.put("lights off pls", "turn off the lights", phrase("lightsOff"));
+        cache.put("louder to 5", "set volume to 5", phrase("setVolume", {"5"}));
+    }
+
+    // entries survive a restart
+    CommandCache restarted(8, path.string(), true);
+    restarted.load(testCommands());
+    assert(restarted.size() == 2);
+    assert(restarted.get("louder to 5")->output == "set volume to 5");
+
+    // a changed catalog discards them
+    std::vector<ConfigVars::Commands> changed = testCommands();
+    changed[0].phrases.push_back("lights off");
+    CommandCache invalidated(8, path.string(), true);
+    invalidated.load(changed);
+    assert(invalidated.size() == 0);
+    assert(CommandCache::catalogHash(changed) != CommandCache::catalogHash(testCommands()));
+
+    // so does a changed priority, parsePhrase may resolve a different command
+    std::vector<ConfigVars::Commands> reprioritized = testCommands();
+    reprioritized[1].priority = 0;
+    assert(CommandCache::catalogHash(reprioritized) != CommandCache::catalogHash(testCommands()));
+
+    restarted.clear();
+    assert(!std::filesystem::exists(path));
+}
+
+int main() {
+    try {
+        std::cout << "Running CommandCache tests..." << std::endl;
+        testNormalize();
+        testLeastRecentlyUsed();
+        testPersistence();
+    } catch (const std::exception& e) {
+        std::cerr << "CommandCache Test failed: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
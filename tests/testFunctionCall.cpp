@@ -39,6 +39,40 @@ void testCheckTypo() {
     assert(result == true);
 }
 
+void testBuildGrammar(ConfigVars::config config) {
+    std::cout << "Testing buildGrammar..." << std::endl;
+    std::string grammar = FunctionCall::buildGrammar(config.commandCalls, "Command not recognized.");
+    assert(grammar.rfind("root ::= ", 0) == 0);
+    assert(grammar.find("(\"what \" word \" is it\")") != std::string::npos);
+    assert(grammar.find("(\"Command not recognized.\")") != std::string::npos);
+    assert(grammar.find("<arg") == std::string::npos);
+}
+
+void testCompletePhrase() {
+    std::cout << "Testing completePhrase..." << std::endl;
+    std::vector<ConfigVars::Commands> commands(1);
+    commands[0].phrases = {"turn on the <arg0> light", "say <arg0->", "set a timer for <arg0> minutes"};
+    std::string literal;
+
+    // the first letter picks the phrase, the space before the argument is left open
+    assert(FunctionCall::completePhrase("t", commands, "", literal) == false);
+    assert(literal == "urn on the");
+    // several phrases start with "s"
+    assert(FunctionCall::completePhrase("s", commands, "", literal) == false);
+    assert(literal.empty());
+    // an argument is being generated
+    assert(FunctionCall::completePhrase("turn on the kitchen", commands, "", literal) == false);
+    assert(literal.empty());
+    // only literal text is left
+    assert(FunctionCall::completePhrase("turn on the kitchen ", commands, "", literal) == true);
+    assert(literal == "light");
+    assert(FunctionCall::completePhrase("C", commands, "Command not recognized.", literal) == true);
+    assert(literal == "ommand not recognized.");
+    // not a phrase at all
+    assert(FunctionCall::completePhrase("x", commands, "", literal) == false);
+    assert(literal.empty());
+}
+
 void testCallFunction(ConfigVars::config config, Model& model, MQTTClient& mqttClient, Voice& voice) {
     std::cout << "Testing call function..." << std::endl;
     FunctionCall::initCommands(config, &mqttClient, &model, &voice, true);
@@ -126,13 +160,20 @@ int main(int argc, char *argv[]) {
     try {
         for (const auto& modelVar : config.models) {
             if (modelVar.purpose == "Chat") {
-                model = Model(modelVar.name, modelVar.purpose, modelPath,
-                              modelVar.ngl, modelVar.n_ctx,
-                              modelVar.init_message,
-                              modelVar.temp, modelVar.min_p,
-                              modelVar.top_p, modelVar.typical,
-                              modelVar.dist, modelVar.top_k,
-                              modelVar.keepHistory, true);
+                model.setModelName(modelVar.name);
+                model.setModelPurpose(modelVar.purpose);
+                model.setModelPath(modelPath);
+                model.setNGL(modelVar.ngl);
+                model.setNCTX(modelVar.n_ctx);
+                model.setInitMessage(modelVar.init_message);
+                model.setTemp(modelVar.temp);
+                model.setMinP(modelVar.min_p);
+                model.setTopP(modelVar.top_p);
+                model.setTypical(modelVar.typical);
+                model.setDist(modelVar.dist);
+                model.setTopK(modelVar.top_k);
+                model.setKeepHistory(modelVar.keepHistory);
+                model.setVerbose(true);
                 break;
             }
         }
@@ -176,6 +217,8 @@ int main(int argc, char *argv[]) {
         testInitCommands(config);
         testParsedPhraseCreation(config);
         testCheckTypo();
+        testBuildGrammar(config);
+        testCompletePhrase();
         testCallFunction(config, model, mqttClient, voice);
         std::cout << "All tests passed!" << std::endl;
     } catch (const std::exception& e) {
@@ -0,0 +1,67 @@
+#include <iostream>
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "../src/intentMatcher.h"
+#include "../src/configReader.h"
+
+void testDot() {
+    // lengths that are not a multiple of the SIMD width use the remainder loop
+    for (int n : {1, 7, 8, 19, 64}) {
+        std::vector<float> a(n), b(n);
+        float expected = 0.0f;
+        for (int i = 0; i < n; i++) {
+            a[i] = 0.5f * i;
+            b[i] = 1.0f - 0.1f * i;
+            expected += a[i] * b[i];
+        }
+        assert(std::fabs(IntentMatcher::dot(a.data(), b.data(), n) - expected) < 1e-3f * (1.0f + std::fabs(expected)));
+    }
+}
+
+void testMatchPhrase(const std::string& modelPath, const std::vector<ConfigVars::Commands>& commands) {
+    IntentMatcher matcher("../" + modelPath, 0, 0.8f, 0.0f, true);
+    matcher.init(commands);
+    assert(matcher.isInitialized());
+    assert(matcher.phraseCount() > 0);
+
+    // a configured phrase is its own closest match
+    auto command = std::find_if(commands.begin(), commands.end(), [](const ConfigVars::Commands& cmd) { return cmd.NArgs == 0; });
+    assert(command != commands.end());
+    IntentMatcher::Match match = matcher.match(command->phrases.front());
+    assert(match.command == command->function);
+    assert(match.score > 0.99f);
+
+    // an utterance longer than the context is cut off instead of being embedded as empty tokens
+    std::string longUtterance;
+    for (int i = 0; i < 400; i++) {
+        longUtterance += command->phrases.front() + " ";
+    }
+    assert(matcher.match(longUtterance).score > 0.5f);
+
+    // nothing is confident with a threshold above the maximum similarity
+    matcher.setThreshold(1.1f);
+    assert(matcher.match(command->phrases.front()).command.empty());
+}
+
+int main() {
+    ConfigReader configReader;
+    try {
+        configReader.readConfig("../config.json", true);
+        configReader.parseConfig();
+    } catch (const std::exception &e) {
+        std::cerr << "Error parsing config: " << e.what() << std::endl;
+        return 1;
+    }
+    try {
+        std::cout << "Running IntentMatcher tests..." << std::endl;
+        testDot();
+        testMatchPhrase(configReader.getModels()[0].path, configReader.getCommandCalls());
+    } catch (const std::exception& e) {
+        std::cerr << "IntentMatcher Test failed: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -1,10 +1,36 @@
 #include <iostream>
 #include <cassert>
 #include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <thread>
 
 #include "../src/model.h"
 #include "../src/configReader.h"
 
+void testModelLookup() {
+    // the trigram ending with the sampled token occurred at the start
+    assert((Model::lookupNgram({1, 2, 3, 4, 1, 2}, 3, 3, 3) == std::vector<llama_token>{4, 1, 2}));
+    // a bigram is tried when the trigram is new
+    assert((Model::lookupNgram({1, 2, 3, 4, 8, 2}, 3, 3, 2) == std::vector<llama_token>{4, 8}));
+    // the latest occurrence wins
+    assert((Model::lookupNgram({1, 2, 5, 1, 2, 6, 1}, 2, 2, 8) == std::vector<llama_token>{6, 1, 2}));
+    // nothing repeats, or there is no room for a draft
+    assert(Model::lookupNgram({1, 2, 3}, 4, 3, 4).empty());
+    assert(Model::lookupNgram({1, 2, 3, 4, 1, 2}, 3, 3, 0).empty());
+    assert(Model::lookupNgram({}, 3, 3, 4).empty());
+}
+
+void testModelShiftDiscard() {
+    // half of the conversation after the system message goes
+    assert(Model::shiftDiscard(10, 100, 1, 128) == 45);
+    // more if the new tokens need it
+    assert(Model::shiftDiscard(10, 110, 80, 128) == 62);
+    // the system message is never discarded
+    assert(Model::shiftDiscard(10, 20, 200, 128) == 0);
+    assert(Model::shiftDiscard(10, 10, 1, 128) == 0);
+}
+
 void testModelInitialization(std::string modelPath) {
     Model model("TestModel", "Testing", "../" + modelPath, 0, 2048, 
                 "This is a test model, you can only respoond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, true, true);
@@ -22,6 +48,247 @@ void testModelResponse(std::string modelPath) {
     assert(response == "Test response"); // Check if the response matches the expected output
 }
 
+void testModelStreaming(std::string modelPath) {
+    Model model("TestModel", "Testing", "../" + modelPath, 0, 2048, 
+                "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, true, true);
+    model.init();
+    
+    std::string streamed = "";
+    int pieces = 0;
+    std::string response = model.respond("Respond to this prompt with \"Test response\"", [&](const std::string &piece) {
+        streamed += piece;
+        pieces++;
+        return true;
+    });
+
+    // the pieces add up to the returned response
+    assert(pieces > 0);
+    assert(streamed == response);
+}
+
+void testModelStopSequences(std::string modelPath) {
+    Model model("TestModel", "Testing", "../" + modelPath, 0, 2048, 
+                "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, false, true);
+    model.init();
+    model.setStopSequences({"3"});
+    
+    // the response ends before the stop sequence
+    std::string response = model.respond("Count from 1 to 5 separated by spaces.");
+    assert(response.find("3") == std::string::npos);
+
+    // the request limit overrides the one of the model
+    std::string streamed = "";
+    Model::GenerationOptions options;
+    options.max_tokens = 2;
+    options.stop = std::vector<std::string>{};
+    response = model.respond("Count from 1 to 5 separated by spaces.", [&](const std::string &piece) {
+        streamed += piece;
+        return true;
+    }, options);
+    assert(streamed == response);
+    assert(!response.empty());
+}
+
+void testModelSmallBatch(std::string modelPath) {
+    Model model("TestModel", "Testing", "../" + modelPath, 0, 2048, 
+                "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, false, true);
+    // prompts longer than a batch are decoded in several calls
+    model.setNBatch(16);
+    model.setNUbatch(16);
+    model.setNThreads(Model::AUTO);
+    model.init();
+
+    assert(!model.respond("Respond to this prompt with \"Test response\"").empty());
+}
+
+void testModelStateless(std::string modelPath) {
+    Model model("TestModel", "Testing", "../" + modelPath, 0, 256, 
+                "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, false, true);
+    model.setNBatch(32);
+    model.setMaxTokens(8);
+    model.init();
+
+    // every request starts again from the system message, many of them fit into a small context
+    int prompt_tokens = 0;
+    for (int i = 0; i < 30; i++) {
+        model.respond("Respond to this prompt with \"Test response\"");
+        if (i == 0) {
+            prompt_tokens = model.getLastPerf().prompt_tokens;
+        }
+        // only the user message is evaluated, in several decode calls of at most n_batch tokens
+        assert(model.getLastPerf().prompt_tokens == prompt_tokens);
+    }
+    assert(model.getMessages().size() == 1);
+}
+
+void testModelPromptCache(std::string modelPath) {
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "azazel-cache-test";
+    std::filesystem::remove_all(dir);
+    auto cacheFiles = [&dir]() {
+        std::vector<std::filesystem::path> files;
+        for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+            if (entry.path().extension() == ".kv") files.push_back(entry.path());
+        }
+        return files;
+    };
+    auto start = [&]() {
+        auto model = std::make_unique<Model>("TestModel", "Testing", "../" + modelPath, 0, 1024, 
+                "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, false, true);
+        model->setCacheDir(dir.string());
+        model->init();
+        return model;
+    };
+
+    // the first start saves the evaluated system message
+    start();
+    auto files = cacheFiles();
+    assert(files.size() == 1);
+    auto saved = std::filesystem::last_write_time(files[0]);
+    uintmax_t size = std::filesystem::file_size(files[0]);
+
+    // the next start loads it instead of saving it again
+    auto model = start();
+    assert(cacheFiles().size() == 1);
+    assert(std::filesystem::last_write_time(files[0]) == saved);
+    assert(model->respond("Respond to this prompt with \"Test response\"") == "Test response");
+
+    // a damaged file is evaluated again and replaced
+    std::filesystem::resize_file(files[0], size / 2);
+    model = start();
+    assert(std::filesystem::file_size(files[0]) == size);
+    assert(!model->respond("Respond to this prompt with \"Test response\"").empty());
+    std::filesystem::remove_all(dir);
+}
+
+void testModelDraft(std::string modelPath) {
+    Model model("TestModel", "Testing", "../" + modelPath, 0, 2048, 
+                "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, true, true);
+    // the model drafting for itself proposes what it samples, the verification has to keep those tokens
+    model.setDraftPath("../" + modelPath);
+    model.setNDraft(4);
+    model.init();
+
+    assert(model.respond("Respond to this prompt with \"Test response\"") == "Test response");
+    Model::DraftStats stats = model.getDraftStats();
+    assert(stats.drafted > 0);
+    assert(stats.accepted > 0 && stats.accepted <= stats.drafted);
+
+    // the verified tokens are the conversation, the next turn continues from them
+    assert(!model.respond("Respond to this prompt with \"Second\"").empty());
+    assert(model.getMessages().size() == 5);
+}
+
+void testModelPromptLookup(std::string modelPath) {
+    Model model("TestModel", "Testing", "../" + modelPath, 0, 2048, 
+                "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, false, true);
+    model.setLookupNgram(3);
+    model.setNDraft(4);
+    model.init();
+
+    // the response repeats the prompt, so there is something to look up
+    std::string phrase = "the kitchen light is on, the kitchen light is on, the kitchen light is on";
+    assert(!model.respond("Repeat exactly: \"" + phrase + "\"").empty());
+    Model::DraftStats stats = model.getDraftStats();
+    assert(stats.drafted > 0);
+    assert(stats.accepted <= stats.drafted);
+}
+
+void testModelContextPolicy(std::string modelPath) {
+    const std::string init = "This is a test model, you can only respond what is explicitly given to you.";
+    const std::string prompt = "Respond to this prompt with \"The quick brown fox jumps over the lazy dog near the river bank\"";
+
+    // shifting keeps the whole history and discards the oldest tokens of the context
+    Model shifted("TestModel", "Testing", "../" + modelPath, 0, 256, init, 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, true, true);
+    shifted.setContextPolicy("shift");
+    shifted.setMaxTokens(24);
+    shifted.init();
+    for (int i = 0; i < 8; i++) {
+        shifted.respond(prompt);
+    }
+    assert(shifted.getMessages().size() == 17);
+    assert(!shifted.respond("Respond to this prompt with \"Test response\"").empty());
+
+    // compaction drops the oldest turns instead, the system message stays
+    Model compacted("TestModel", "Testing", "../" + modelPath, 0, 256, init, 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, true, true);
+    compacted.setContextPolicy("compact");
+    compacted.setMaxTokens(24);
+    compacted.init();
+    for (int i = 0; i < 8; i++) {
+        compacted.respond(prompt);
+    }
+    auto messages = compacted.getMessages();
+    assert(messages.size() < 17);
+    assert(messages[0].role == "system" && messages[0].content == init);
+    assert(messages.back().role == "assistant");
+}
+
+void testModelCompletionLimit(std::string modelPath) {
+    Model model("TestModel", "Testing", "../" + modelPath, 0, 2048, 
+                "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, false, true);
+    model.setMaxTokens(4);
+    // a long literal completes the response after the first token
+    model.setCompletionHook([](const std::string &) {
+        return Model::Completion{" one two three four five six seven eight nine ten", true};
+    });
+    model.init();
+
+    // the forced text counts against the limit
+    std::string response = model.respond("Respond to this prompt with \"Test response\"");
+    assert(model.getLastPerf().generated_tokens == 4);
+    assert(response.find("ten") == std::string::npos);
+}
+
+void testModelQuantizedCache(std::string modelPath) {
+    Model model("TestModel", "Testing", "../" + modelPath, 0, 2048, 
+                "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, false, true);
+    model.init();
+    Model quantized("TestModel", "Testing", "../" + modelPath, 0, 2048, 
+                "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, false, true);
+    quantized.setTypeK("q8_0");
+    quantized.setTypeV("q8_0");
+    quantized.init();
+
+    // q8_0 takes about half the memory of f16
+    assert(quantized.getMemoryUsage().kv_cache < model.getMemoryUsage().kv_cache);
+    assert(!quantized.respond("Respond to this prompt with \"Test response\"").empty());
+
+    // a quantized V cache is rejected without flash attention
+    Model invalid("TestModel", "Testing", "../" + modelPath, 0, 2048, 
+                "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, false, true);
+    invalid.setTypeV("q4_0");
+    invalid.setFlashAttn("off");
+    bool thrown = false;
+    try {
+        invalid.init();
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+void testModelPerfStats(std::string modelPath) {
+    Model model("TestModel", "Testing", "../" + modelPath, 0, 2048, 
+                "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, false, true);
+    std::filesystem::path log = std::filesystem::temp_directory_path() / "azazel-perf-test.jsonl";
+    std::filesystem::remove(log);
+    model.setPerfLog(log.string());
+    model.init();
+    
+    model.respond("Respond to this prompt with \"Test response\"");
+    Model::PerfStats perf = model.getLastPerf();
+    assert(perf.prompt_tokens > 0);
+    assert(perf.generated_tokens > 0);
+    assert(perf.ttft_ms > 0 && perf.ttft_ms <= perf.total_ms);
+    assert(perf.prefillTokensPerSecond() > 0);
+
+    // one JSON line per generation
+    std::ifstream file(log);
+    std::string line;
+    assert(std::getline(file, line));
+    assert(line.find("\"generated_tokens\":" + std::to_string(perf.generated_tokens)) != std::string::npos);
+    std::filesystem::remove(log);
+}
+
 void testModelChatHistory(std::string modelPath) {
     Model model("TestModel", "Testing", "../" + modelPath, 0, 2048, 
                 "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, true, true);
@@ -34,6 +301,81 @@ void testModelChatHistory(std::string modelPath) {
     assert(model.getMessages().size() == 3); // 1 system message + 1 user messages + 1 assistant message
 }
 
+void testModelMultiTurn(std::string modelPath) {
+    Model model("TestModel", "Testing", "../" + modelPath, 0, 2048, 
+                "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, true, true);
+    model.init();
+    
+    // the second turn is appended to the evaluated conversation
+    assert(!model.respond("Respond to this prompt with \"First\"").empty());
+    assert(!model.respond("Respond to this prompt with \"Second\"").empty());
+    assert(model.getMessages().size() == 5); // 1 system message + 2 user messages + 2 assistant messages
+}
+
+void testModelSharedUnload(std::string modelPath) {
+    ModelRegistry::declareContextGroup("test-unload", 2, 2048);
+    Model commandModel("TestCommand", "Command", "../" + modelPath, 0, 1024, "Test", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, false, true);
+    Model chatModel("TestChat", "Chat", "../" + modelPath, 0, 1024, "Test", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, true, true);
+    for (Model *model : {&commandModel, &chatModel}) {
+        model->setContextGroup("test-unload");
+        model->setUnloadWeights(true);
+        model->init();
+    }
+
+    // the context and the weights stay alive through the other model
+    assert(commandModel.freeableMemory() == 0);
+    assert(chatModel.freeableMemory() == 0);
+    assert(chatModel.unload());
+
+    // the last model holding them frees both
+    assert(commandModel.freeableMemory() >= commandModel.getMemoryUsage().weights);
+    assert(commandModel.unload());
+    assert(commandModel.freeableMemory() == 0);
+}
+
+void testModelSharedWeights(std::string modelPath) {
+    Model commandModel("TestCommand", "Command", "../" + modelPath, 0, 2048, 
+                "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, false, true);
+    Model chatModel("TestChat", "Chat", "../" + modelPath, 0, 2048, 
+                "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, true, true);
+    commandModel.init();
+    chatModel.init();
+
+    // both models use the same weights
+    assert(ModelRegistry::loadedModels() == 1);
+}
+
+void testModelContextGroup(std::string modelPath) {
+    // the group decides the batch sizes, whichever model loads first
+    ModelRegistry::declareContextGroup("test", 2, 2048, 256, 128);
+    Model commandModel("TestCommand", "Command", "../" + modelPath, 0, 1024, 
+                "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, false, true);
+    commandModel.setContextGroup("test");
+    commandModel.setNBatch(64);
+    commandModel.init();
+    Model chatModel("TestChat", "Chat", "../" + modelPath, 0, 1024, 
+                "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, true, true);
+    chatModel.setContextGroup("test");
+    chatModel.init();
+    assert(!chatModel.respond("Respond to this prompt with \"Test response\"").empty());
+
+    // one KV cache cannot hold two cache types
+    ModelRegistry::declareContextGroup("test-mismatch", 2, 2048);
+    Model f16Model("TestF16", "Command", "../" + modelPath, 0, 1024, "Test", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, false, true);
+    f16Model.setContextGroup("test-mismatch");
+    f16Model.init();
+    Model q8Model("TestQ8", "Chat", "../" + modelPath, 0, 1024, "Test", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, false, true);
+    q8Model.setContextGroup("test-mismatch");
+    q8Model.setTypeK("q8_0");
+    bool rejected = false;
+    try {
+        q8Model.init();
+    } catch (const std::runtime_error &) {
+        rejected = true;
+    }
+    assert(rejected);
+}
+
 void testModelClearHistory(std::string modelPath) {
     Model model("TestModel", "Testing", "../" + modelPath, 0, 2048, 
                 "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, true, true);
@@ -49,6 +391,188 @@ void testModelClearHistory(std::string modelPath) {
     assert(model.getMessages().size() == 1); // Only the system message should remain
 }
 
+void testModelUnload(std::string modelPath) {
+    Model model("TestModel", "Testing", "../" + modelPath, 0, 2048, 
+                "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, true, true);
+    model.setUnloadWeights(true);
+    model.init();
+    
+    model.respond("Respond to this prompt with \"First\"");
+    // the context and the weights are only held by this model
+    assert(model.freeableMemory() >= model.getMemoryUsage().kv_cache + model.getMemoryUsage().weights);
+    assert(model.unload());
+    assert(!model.isLoaded());
+    assert(model.freeableMemory() == 0);
+    assert(model.residentMemory() == 0);
+    
+    // the next request reloads the model and continues the conversation
+    assert(!model.respond("Respond to this prompt with \"Second\"").empty());
+    assert(model.isLoaded());
+    assert(model.getMessages().size() == 5); // 1 system message + 2 user messages + 2 assistant messages
+}
+
+void testModelSession(std::string modelPath) {
+    std::filesystem::path session = std::filesystem::temp_directory_path() / "azazel-session-test.session";
+    std::filesystem::remove(session);
+    {
+        Model model("TestModel", "Testing", "../" + modelPath, 0, 2048, 
+                    "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, true, true);
+        model.setSessionFile(session.string());
+        model.init();
+        model.respond("Respond to this prompt with \"First\"");
+    } // the session is saved when the model is destroyed
+    assert(std::filesystem::exists(session));
+
+    {
+        // the next start continues the conversation
+        Model restored("TestModel", "Testing", "../" + modelPath, 0, 2048, 
+                    "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, true, true);
+        restored.setSessionFile(session.string());
+        restored.init();
+        assert(restored.getMessages().size() == 3); // 1 system message + 1 user message + 1 assistant message
+        assert(restored.getMessages()[1].content == "Respond to this prompt with \"First\"");
+        assert(!restored.respond("Respond to this prompt with \"Second\"").empty());
+    }
+
+    // a session of another context size keeps the history, only the KV state is evaluated again
+    Model resized("TestModel", "Testing", "../" + modelPath, 0, 1024, 
+                "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, true, true);
+    resized.init();
+    assert(resized.restoreSession(session.string()));
+    assert(resized.getMessages().size() == 5);
+
+    // a truncated file is ignored instead of allocating the sizes it claims
+    std::filesystem::resize_file(session, std::filesystem::file_size(session) / 2);
+    assert(!resized.restoreSession(session.string()));
+    {
+        std::fstream corrupt(session, std::ios::in | std::ios::out | std::ios::binary);
+        corrupt.seekp(12); // header size after the magic and the version
+        uint64_t huge = ~0ull;
+        corrupt.write(reinterpret_cast<const char *>(&huge), sizeof(huge));
+    }
+    assert(!resized.restoreSession(session.string()));
+    assert(resized.getMessages().size() == 5);
+    std::filesystem::remove(session);
+}
+
+void testModelConversations(std::string modelPath) {
+    Model model("TestModel", "Testing", "../" + modelPath, 0, 1024, 
+                "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, true, true);
+    model.setSessions(2);
+    model.init();
+
+    // three conversations in two sequences, the least recently used one is parked on disk
+    assert(!model.respondInSession("alice", "Respond to this prompt with \"Alice\"").empty());
+    assert(!model.respondInSession("bob", "Respond to this prompt with \"Bob\"").empty());
+    assert(!model.respondInSession("carol", "Respond to this prompt with \"Carol\"").empty());
+    assert(model.getMessages().size() == 3); // each conversation has its own history
+    assert(model.getSessionNames().size() == 4); // the default conversation included
+
+    // the parked conversation continues where it stopped
+    assert(!model.respondInSession("alice", "Respond to this prompt with \"Alice again\"").empty());
+    assert(model.getMessages().size() == 5);
+    assert(model.getMessages()[1].content == "Respond to this prompt with \"Alice\"");
+
+    model.endSession("bob");
+    assert(model.getSessionNames().size() == 3);
+
+    // respond continues the default conversation
+    model.respond("Is response successful?");
+    assert(model.getMessages().size() == 3);
+}
+
+void testModelParallel(std::string modelPath) {
+    Model model("TestModel", "Testing", "../" + modelPath, 0, 1024, 
+                "This is a test model, you can only respond what is explicitly given to you.", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, false, true);
+    model.setParallel(2);
+    model.setMaxTokens(16);
+    model.init();
+
+    // more requests than slots, the third one joins when a slot is free
+    std::vector<std::string> responses(3);
+    std::vector<std::thread> clients;
+    for (size_t i = 0; i < responses.size(); i++) {
+        clients.emplace_back([&model, &responses, i]() {
+            responses[i] = model.respond("Respond to this prompt with \"Request " + std::to_string(i) + "\"");
+        });
+    }
+    for (auto &client : clients) {
+        client.join();
+    }
+    for (const auto &response : responses) {
+        assert(!response.empty());
+    }
+
+    // streamed pieces add up to the response of the slot
+    std::string streamed = "";
+    std::string response = model.respond("Respond to this prompt with \"Streamed\"", [&streamed](const std::string &piece) {
+        streamed += piece;
+        return true;
+    });
+    assert(streamed == response);
+    assert(model.getMessages().size() == 1); // requests are stateless
+    assert(model.getLastPerf().generated_tokens > 0);
+    assert(model.getSeqId() == 2); // the slots are the sequences before it
+
+    // the slots are freed with the context and come back with it
+    assert(model.unload());
+    assert(!model.respond("Respond to this prompt with \"Reloaded\"").empty());
+
+    // history cannot be batched
+    Model chat("TestModel", "Testing", "../" + modelPath, 0, 1024, "Test", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, true, true);
+    chat.setParallel(2);
+    bool rejected = false;
+    try {
+        chat.init();
+    } catch (const std::invalid_argument &) {
+        rejected = true;
+    }
+    assert(rejected);
+
+    // the slots need the whole context
+    Model grouped("TestModel", "Testing", "../" + modelPath, 0, 1024, "Test", 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, false, true);
+    grouped.setParallel(2);
+    grouped.setContextGroup("parallel");
+    rejected = false;
+    try {
+        grouped.init();
+    } catch (const std::invalid_argument &) {
+        rejected = true;
+    }
+    assert(rejected);
+}
+
+void testModelSummary(std::string modelPath) {
+    const std::string init = "This is a test model, you can only respond what is explicitly given to you.";
+    Model model("TestModel", "Testing", "../" + modelPath, 0, 2048, init, 0.5f, 0.1f, 0.9f, 0.9f, 0.9f, 10, true, true);
+    model.setSummaryBudget(16);
+    model.setSummaryIdle(3600); // summarized by hand below, not by the background worker
+    model.init();
+    model.respond("Respond to this prompt with \"My name is Alice\"");
+    model.respond("Respond to this prompt with \"I live in Berlin\"");
+    assert(model.getMessages().size() == 5);
+
+    // the old turns go into the system message, the last turn stays as it is
+    int generated_tokens = model.getLastPerf().generated_tokens;
+    assert(model.summarizeHistory());
+    assert(model.getLastPerf().generated_tokens == generated_tokens); // the summary is not reported as a request
+    auto messages = model.getMessages();
+    assert(messages.size() == 3);
+    assert(messages[0].role == "system");
+    assert(messages[0].content.rfind(init, 0) == 0);
+    assert(messages[0].content.size() > init.size());
+    assert(messages[1].content == "Respond to this prompt with \"I live in Berlin\"");
+    assert(std::count_if(messages.begin(), messages.end(), [](const auto &msg) { return msg.role == "system"; }) == 1);
+
+    // the compacted history continues
+    assert(!model.respond("Respond to this prompt with \"Done\"").empty());
+    assert(model.getMessages().size() == 5);
+
+    // nothing to summarize below the budget
+    model.setSummaryBudget(100000);
+    assert(!model.summarizeHistory());
+}
+
 int main(int argc, char *argv[]) {
     ConfigReader configReader;
     try {
@@ -60,10 +584,32 @@ int main(int argc, char *argv[]) {
     }
     try {
         std::cout << "Running Model tests..." << std::endl;
+        testModelLookup();
+        testModelShiftDiscard();
         testModelInitialization(configReader.getModels()[0].path);
         testModelResponse(configReader.getModels()[0].path);
+        testModelStreaming(configReader.getModels()[0].path);
+        testModelStopSequences(configReader.getModels()[0].path);
+        testModelSmallBatch(configReader.getModels()[0].path);
+        testModelStateless(configReader.getModels()[0].path);
+        testModelPromptCache(configReader.getModels()[0].path);
+        testModelDraft(configReader.getModels()[0].path);
+        testModelPromptLookup(configReader.getModels()[0].path);
+        testModelContextPolicy(configReader.getModels()[0].path);
+        testModelCompletionLimit(configReader.getModels()[0].path);
+        testModelQuantizedCache(configReader.getModels()[0].path);
+        testModelPerfStats(configReader.getModels()[0].path);
         testModelChatHistory(configReader.getModels()[0].path);
+        testModelMultiTurn(configReader.getModels()[0].path);
+        testModelSharedWeights(configReader.getModels()[0].path);
+        testModelContextGroup(configReader.getModels()[0].path);
         testModelClearHistory(configReader.getModels()[0].path);
+        testModelUnload(configReader.getModels()[0].path);
+        testModelSharedUnload(configReader.getModels()[0].path);
+        testModelSession(configReader.getModels()[0].path);
+        testModelConversations(configReader.getModels()[0].path);
+        testModelSummary(configReader.getModels()[0].path);
+        testModelParallel(configReader.getModels()[0].path);
     } catch (const std::exception& e) {
         std::cerr << "Model Test failed: " << e.what() << std::endl;
         return 1; // Return a non-zero value to indicate failure
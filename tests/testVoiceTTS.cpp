@@ -29,6 +29,30 @@ void testVoiceVolumeScaling(const std::string& modelPath, const std::string& con
     assert(true);
 }
 
+void testSentenceSplitter() {
+    SentenceSplitter splitter;
+    std::vector<std::string> sentences = splitter.push("Hello there. How");
+    assert(sentences.size() == 1);
+    assert(sentences[0] == "Hello there.");
+    sentences = splitter.push(" are you? Version 3.14 is");
+    assert(sentences.size() == 1);
+    assert(sentences[0] == "How are you?");
+    assert(splitter.push(" out").empty());
+    assert(splitter.flush() == "Version 3.14 is out");
+    assert(splitter.flush().empty());
+}
+
+void testVoiceStream(const std::string& modelPath, const std::string& configPath, const std::string& espeakDataPath) {
+    Voice voice(modelPath, configPath, espeakDataPath, 22050, "stream_output.wav", 1.0f, 0.667f, 0.8f, true, true);
+    voice.init();
+    voice.startStream();
+    voice.queueSentence("This is the first sentence.");
+    voice.queueSentence("This is the second sentence.");
+    voice.finishStream();
+    // Since we cannot easily verify audio output in a unit test, we assume no exceptions means success
+    assert(true);
+}
+
 int main(int argc, char* argv[]) {
     ConfigReader configReader;
     ConfigVars::config config;
@@ -47,9 +71,11 @@ int main(int argc, char* argv[]) {
 
     try {
         std::cout << "Running Voice tests..." << std::endl;
+        testSentenceSplitter();
         testVoiceInitialization(modelPath, configPath, espeakDataPath);
         testVoiceSpeak(modelPath, configPath, espeakDataPath);
         testVoiceVolumeScaling(modelPath, configPath, espeakDataPath);
+        testVoiceStream(modelPath, configPath, espeakDataPath);
     } catch (const std::exception& e) {
         std::cerr << "Voice Test failed: " << e.what() << std::endl;
         return 1;